@@ -10,12 +10,26 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#define ring_calloc(n, size) kvcalloc(n, size, GFP_KERNEL)
+#define ring_free(ptr) kvfree(ptr)
 #else
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#define ring_calloc(n, size) calloc(n, size)
+#define ring_free(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+// The entry @param index places after the oldest one
+static struct aesd_buffer_entry *entry_at(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return &buffer->entry[(buffer->out_offs + index) & buffer->mask];
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,40 +39,50 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * The entries are binary searched on their start, so the cost is logarithmic in the number of entries.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t cumulative_size = 0;
-    uint8_t index = buffer->out_offs;
-    uint8_t count = 0;
+    uint32_t low = 0;
+    uint32_t high;
+    struct aesd_buffer_entry *entry;
 
     if (buffer == NULL || entry_offset_byte_rtn == NULL) {
         return NULL;
     }
 
-    while (count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        struct aesd_buffer_entry *entry = &buffer->entry[index];
+    if (char_offset >= buffer->in_pos - buffer->out_pos) {
+        return NULL; // char_offset not found
+    }
 
-        if (entry->size == 0) {
-            return NULL; // No more valid entries
-        }
+    // The last entry starting at or before char_offset holds it
+    high = buffer->count - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
 
-        if (cumulative_size + entry->size > char_offset) {
-            *entry_offset_byte_rtn = char_offset - cumulative_size;
-            return entry;
+        if (entry_at(buffer, middle)->start - buffer->out_pos <= char_offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
         }
+    }
 
-        cumulative_size += entry->size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        count++;
+    entry = entry_at(buffer, low);
+    *entry_offset_byte_rtn = char_offset - (entry->start - buffer->out_pos);
+    return entry;
+}
 
-        if (index == buffer->in_offs && !buffer->full) {
-            break; // Reached the end of valid entries
-        }
-    }
+/**
+ * @return the entry added after @param entry of @param buffer, or NULL if it is the most recent one.
+ * Lets a reader walk the buffer in order after a single lookup.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry)
+{
+    uint32_t index = ((uint32_t)(entry - buffer->entry) - buffer->out_offs) & buffer->mask;
 
-    return NULL; // char_offset not found
+    return index + 1 < buffer->count ? entry_at(buffer, index + 1) : NULL;
 }
 
 /**
@@ -67,99 +91,105 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry that was overwritten, for the caller to release, or NULL
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    if (buffer == NULL || add_entry == NULL) {
-        return;
+    const char *overwritten = NULL;
+
+    if (buffer == NULL || add_entry == NULL || buffer->depth == 0) {
+        return NULL;
+    }
+
+    // The oldest entry makes room when the buffer is full
+    if (buffer->full) {
+        overwritten = buffer->entry[buffer->out_offs].buffptr;
+        buffer->out_pos += buffer->entry[buffer->out_offs].size;
+        buffer->entry[buffer->out_offs].buffptr = NULL;
+        buffer->entry[buffer->out_offs].size = 0;
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+        buffer->count--;
     }
 
-    // Add the new entry at the current in_offs position
+    // Add the new entry at the current in_offs position, extending the running total
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].start = buffer->in_pos;
+    buffer->in_pos += add_entry->size;
 
     // Advance the in_offs index
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-    // If the buffer was already full, advance the out_offs index
-    if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+    buffer->count++;
 
     // Check if the buffer is now full
-    if (buffer->in_offs == buffer->out_offs) {
-        buffer->full = true;
-    } else {
-        buffer->full = false;
-    }
+    buffer->full = buffer->count == buffer->depth;
+
+    return overwritten;
 }
 
 size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
 {
-    size_t size = 0;
-
-    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        struct aesd_buffer_entry entry = buffer->entry[i];
-        if (!entry.buffptr)
-        {
-            break; 
-        }
-        else
-        {
-            size += entry.size;
-        }
-    }
-
-    return size;
+    return buffer->in_pos - buffer->out_pos;
 }
 
 size_t aesd_circular_write_cmd_size(struct aesd_circular_buffer *buffer)
 {
-    size_t size = 0;
+    return buffer->count;
+}
 
-    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        struct aesd_buffer_entry entry = buffer->entry[i];
-        if (!entry.buffptr)
-        {
-            break; 
-        }
-        else
-        {
-            size++;
-        }
+extern size_t aesd_circular_calculate_cmd_offset(
+    struct aesd_circular_buffer *buffer, uint32_t write_cmd)
+{
+    if (write_cmd >= buffer->count)
+    {
+        return 0;
     }
 
-    return size;
+    return entry_at(buffer, write_cmd)->start - buffer->out_pos;
 }
 
-extern size_t aesd_circular_calculate_cmd_offset(
-    struct aesd_circular_buffer *buffer, uint32_t write_cmd)
+/**
+* Initializes the circular buffer described by @param buffer to an empty buffer keeping
+* @param depth write operations, with the next power of two of slots
+* @return 0 on success, -EINVAL if depth is 0 or above AESDCHAR_MAX_HISTORY_DEPTH, -ENOMEM
+*/
+int aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint32_t depth)
 {
-    size_t size = 0;
+    uint32_t slots = 1;
 
-    if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {
-        return size;
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+
+    if (depth == 0 || depth > AESDCHAR_MAX_HISTORY_DEPTH) {
+        return -EINVAL;
     }
 
-    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        struct aesd_buffer_entry entry = buffer->entry[i];
-        if (!entry.buffptr || i == write_cmd)
-        {
-            break; 
-        }
-        else
-        {
-            size += entry.size;
-        }
+    while (slots < depth) {
+        slots <<= 1;
+    }
+
+    buffer->entry = ring_calloc(slots, sizeof(struct aesd_buffer_entry));
+    if (buffer->entry == NULL) {
+        return -ENOMEM;
     }
 
-    return size;
+    buffer->mask = slots - 1;
+    buffer->depth = depth;
+    return 0;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty buffer keeping
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED write operations
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
+    aesd_circular_buffer_init_depth(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Releases the slots of @param buffer. The memory its entries reference is left to the caller.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    ring_free(buffer->entry);
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * The history depth aesd_circular_buffer_init() sets up, and the default of the driver
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * The largest history depth aesd_circular_buffer_init_depth() accepts
+ */
+#define AESDCHAR_MAX_HISTORY_DEPTH (1U << 20)
 
 struct aesd_buffer_entry
 {
@@ -28,36 +35,64 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Running total of the bytes added to the buffer before this entry, set by
+     * aesd_circular_buffer_add_entry(). Only differences are meaningful, so wrapping is harmless.
+     */
+    size_t start;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * Slots for the most recent write operations. There are mask + 1 of them, a power
+     * of two, so a location wraps with a mask instead of a division.
+     */
+    struct aesd_buffer_entry *entry;
+    uint32_t mask;
+    /**
+     * The number of write operations kept before the oldest is overwritten, at most mask + 1
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t depth;
+    /**
+     * The number of write operations currently stored
+     */
+    uint32_t count;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds depth entries
      */
     bool full;
+    /**
+     * The start of the oldest entry and of the next one to be added; their difference is the
+     * size of the buffer and start - out_pos the position of an entry within it
+     */
+    size_t out_pos;
+    size_t in_pos;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry);
+
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint32_t depth);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
 extern size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
 
 extern size_t aesd_circular_write_cmd_size(struct aesd_circular_buffer *buffer);
@@ -70,9 +105,9 @@ extern size_t aesd_circular_calculate_cmd_offset(
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -81,7 +116,7 @@ extern size_t aesd_circular_calculate_cmd_offset(
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -10,6 +10,7 @@
 
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -29,7 +30,8 @@
 struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure      */
-    struct mutex mutex;   /* Mutex for synchronizing access */
+    struct mutex mutex;   /* Serializes writers and guards the pending write command */
+    struct rw_semaphore history_lock; /* Shared by readers, exclusive while the ring changes */
 };
 
 
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Read scaling benchmark for /dev/aesdchar. For 1, 2, 4, ... up to the
+ * requested number of threads, every thread opens the device on its own and
+ * reads the whole history over and over with pread() for a fixed time. The
+ * aggregate throughput of each step is compared with the single thread one,
+ * so readers that do not serialize on each other show a speedup close to
+ * the thread count, as long as the machine has that many cores.
+ *
+ * With -f the history is first filled with that many records, and the
+ * driver keeps at most its history_depth of them.
+ */
+
+typedef struct bench_config {
+    const char *device;
+    int threads;
+    int duration;
+    size_t read_size;
+    int fill_records;
+    size_t record_size;
+} bench_config_t;
+
+typedef struct bench_reader {
+    pthread_t thread;
+    unsigned long bytes;
+    unsigned long passes;
+    int failed;
+} bench_reader_t;
+
+static bench_config_t config = {
+    .device = "/dev/aesdchar",
+    .threads = 0,
+    .duration = 3,
+    .read_size = 65536,
+    .fill_records = 0,
+    .record_size = 64
+};
+
+static volatile int stop_flag = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill_history(void) {
+    char *record = malloc(config.record_size);
+    int fd = open(config.device, O_WRONLY);
+
+    if (record == NULL || fd == -1) {
+        perror("fill");
+        free(record);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < config.fill_records; i++) {
+        memset(record, 'a' + i % 26, config.record_size - 1);
+        record[config.record_size - 1] = '\n';
+        if (write(fd, record, config.record_size) != (ssize_t)config.record_size) {
+            perror("write");
+            close(fd);
+            free(record);
+            return -1;
+        }
+    }
+
+    close(fd);
+    free(record);
+    return 0;
+}
+
+static void* bench_reader(void* arg) {
+    bench_reader_t *reader = (bench_reader_t*)arg;
+    char *buffer = malloc(config.read_size);
+    int fd = open(config.device, O_RDONLY);
+    off_t pos = 0;
+
+    if (buffer == NULL || fd == -1) {
+        perror("reader");
+        reader->failed = 1;
+        free(buffer);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    while (!stop_flag) {
+        ssize_t n = pread(fd, buffer, config.read_size, pos);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            reader->failed = 1;
+            break;
+        }
+        if (n == 0) {
+            // End of the history, start over
+            reader->passes++;
+            pos = 0;
+            continue;
+        }
+        reader->bytes += n;
+        pos += n;
+    }
+
+    close(fd);
+    free(buffer);
+    return NULL;
+}
+
+// Run @param threads readers for the configured duration; @return aggregate bytes per second, -1 on failure
+static double run_step(int threads, unsigned long *passes) {
+    bench_reader_t *readers = calloc(threads, sizeof(bench_reader_t));
+    unsigned long bytes = 0;
+    int failed = 0;
+    double start;
+
+    if (readers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    stop_flag = 0;
+    start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&readers[i].thread, NULL, bench_reader, &readers[i]) != 0) {
+            perror("pthread_create");
+            stop_flag = 1;
+            threads = i;
+            failed = 1;
+            break;
+        }
+    }
+
+    if (!failed) {
+        sleep(config.duration);
+    }
+    stop_flag = 1;
+
+    *passes = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        bytes += readers[i].bytes;
+        *passes += readers[i].passes;
+        failed |= readers[i].failed;
+    }
+    double elapsed = now_seconds() - start;
+
+    free(readers);
+    return failed ? -1 : bytes / elapsed;
+}
+
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-d device] [-c max_threads] [-t seconds_per_step] [-b read_bytes] "
+            "[-f fill_records] [-s record_bytes]\n", program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:c:t:b:f:s:")) != -1) {
+        switch (opt) {
+            case 'd':
+                config.device = optarg;
+                break;
+            case 'c':
+                config.threads = atoi(optarg);
+                break;
+            case 't':
+                config.duration = atoi(optarg);
+                break;
+            case 'b':
+                config.read_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                config.fill_records = atoi(optarg);
+                break;
+            case 's':
+                config.record_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (config.threads == 0) {
+        config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (config.threads < 1 || config.duration < 1 || config.read_size < 1 ||
+        config.fill_records < 0 || config.record_size < 1) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (config.fill_records > 0 && fill_history() == -1) {
+        return 1;
+    }
+
+    printf("%s, %zu byte reads, %d s per step, %ld online cpus\n",
+           config.device, config.read_size, config.duration, sysconf(_SC_NPROCESSORS_ONLN));
+
+    double single = 0;
+    for (int threads = 1; ; threads = threads * 2 > config.threads && threads < config.threads ?
+                                      config.threads : threads * 2) {
+        unsigned long passes;
+        double rate = run_step(threads, &passes);
+
+        if (rate < 0) {
+            return 1;
+        }
+        if (threads == 1) {
+            single = rate;
+        }
+
+        double speedup = single > 0 ? rate / single : 0;
+        printf("threads %3d: %9.2f MB/s, %lu full passes, speedup %.2fx (%.0f%% of linear)\n",
+               threads, rate / 1e6, passes, speedup, speedup / threads * 100);
+
+        if (threads >= config.threads) {
+            break;
+        }
+    }
+
+    return 0;
+}
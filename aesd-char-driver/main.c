@@ -16,33 +16,65 @@
 #include "aesd_ioctl.h"
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/version.h>
 #include <linux/fs.h> // file_operations
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
-#define MAX_HISTORY 10
+#define AESD_STAGING_SIZE PAGE_SIZE // Bytes copied from userspace per pass of aesd_write()
+#define AESD_MAX_MAP_BYTES (1U << 30)
 
 MODULE_AUTHOR("vilmursss"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned int history_depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(history_depth, uint, 0444);
+MODULE_PARM_DESC(history_depth, "Write commands kept in the history, changed at runtime with AESDCHAR_IOCSETDEPTH");
+
+static unsigned int history_map_bytes = 1U << 20;
+module_param(history_map_bytes, uint, 0444);
+MODULE_PARM_DESC(history_map_bytes, "Bytes of recent history mmap() exposes, rounded up to a power of two, 0 disables mmap");
+
 struct aesd_dev aesd_device;
 
+/**
+ * A write command that has not seen its newline yet. The bytes accumulate in
+ * whole pages that never move once written, so appending costs the same
+ * however long the command already is.
+ */
+struct aesd_pending {
+    struct page **pages;        // kvmalloc'd, handed over to vmap() with the pages
+    unsigned int nr_pages;      // Pages allocated, the last ones may be unused after a failed append
+    unsigned int max_pages;     // Slots in pages
+    size_t length;
+};
+
 struct aesd_circular_buffer aesd_buf;
-static char* current_buffer = NULL;
-static size_t current_length = 0;
+static struct aesd_pending pending;
+
+// The header page followed by the data area that mmap() exposes, see struct aesd_mmap_header
+static void *history_map = NULL;
+static size_t history_map_size = 0;
 
 loff_t aesd_llseek(struct file *file, loff_t offset, int whence) {
     loff_t new_pos = 0;
     size_t buff_size = 0;
-    size_t write_cmd_size = 0;
 
+    if (down_read_interruptible(&aesd_device.history_lock)) {
+        return -ERESTARTSYS;
+    }
     buff_size = aesd_circular_buffer_size(&aesd_buf);
-    write_cmd_size = aesd_circular_write_cmd_size(&aesd_buf);
+    up_read(&aesd_device.history_lock);
 
     switch (whence) {
         case SEEK_SET:
@@ -75,7 +107,7 @@ loff_t aesd_llseek(struct file *file, loff_t offset, int whence) {
             return -EINVAL;
     }
 
-    if (new_pos < 0 || write_cmd_size >= MAX_HISTORY)
+    if (new_pos < 0)
     {
         return -EINVAL;
     }
@@ -106,14 +138,15 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
     size_t bytes_read = 0;
     struct aesd_buffer_entry *entry;
 
-    if (mutex_lock_interruptible(&aesd_device.mutex)) {
+    // Readers only exclude changes to the ring, not each other
+    if (down_read_interruptible(&aesd_device.history_lock)) {
         return -ERESTARTSYS;
     }
 
     // Find the starting entry and offset within the entry
     entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_buf, *f_pos, &entry_offset_byte);
     if (!entry) {
-        mutex_unlock(&aesd_device.mutex);
+        up_read(&aesd_device.history_lock);
         return 0; // No data available, indicating EOF
     }
 
@@ -125,7 +158,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
         }
 
         if (copy_to_user(buf + bytes_read, entry->buffptr + entry_offset_byte, copy_size)) {
-            mutex_unlock(&aesd_device.mutex);
+            up_read(&aesd_device.history_lock);
             return -EFAULT;
         }
 
@@ -134,76 +167,267 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
 
         // Move to the next entry
         entry_offset_byte = 0;
-        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_buf, *f_pos, &entry_offset_byte);
+        entry = aesd_circular_buffer_next_entry(&aesd_buf, entry);
     }
 
-    mutex_unlock(&aesd_device.mutex);
+    up_read(&aesd_device.history_lock);
     return bytes_read;
 }
 
+/**
+ * Copy @param size bytes of a new write command into the mapped data area, or with a NULL
+ * @param record only refresh the layout, then bump the generation. Callers hold
+ * aesd_device.mutex; userspace reads without locking, so tail moves before the bytes it gives
+ * up are overwritten and head only after the new bytes are in place.
+ */
+static void aesd_map_publish(const char *record, size_t size)
+{
+    struct aesd_mmap_header *header = history_map;
+    char *data = (char *)history_map + PAGE_SIZE;
+    u64 head;
+
+    if (!header) {
+        return;
+    }
+
+    head = header->head;
+    if (record) {
+        // Only the end of a command larger than the data area can stay in it
+        size_t skip = size > history_map_size ? size - history_map_size : 0;
+        size_t offset = (head + skip) & (history_map_size - 1);
+        size_t first = min_t(size_t, size - skip, history_map_size - offset);
+
+        if (head + size > header->tail + history_map_size) {
+            WRITE_ONCE(header->tail, head + size - history_map_size);
+            smp_wmb();
+        }
+
+        memcpy(data + offset, record + skip, first);
+        memcpy(data, record + skip + first, size - skip - first);
+        head += size;
+
+        smp_wmb();
+        WRITE_ONCE(header->head, head);
+    }
+
+    WRITE_ONCE(header->history_tail, head - aesd_circular_buffer_size(&aesd_buf));
+    WRITE_ONCE(header->depth, aesd_buf.depth);
+    WRITE_ONCE(header->count, aesd_buf.count);
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+// The ring leaves the memory of the entry it overwrites to us, no reader can see it once we drop the lock
+static void aesd_add_record(const char *record, size_t size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = record, .size = size };
+    const char *overwritten;
+
+    down_write(&aesd_device.history_lock);
+    overwritten = aesd_circular_buffer_add_entry(&aesd_buf, &entry);
+    up_write(&aesd_device.history_lock);
+
+    aesd_map_publish(record, size);
+    kvfree(overwritten);
+}
+
+// Append @param len bytes, growing the page array geometrically so each byte costs O(1)
+static int aesd_pending_append(struct aesd_pending *p, const char *data, size_t len)
+{
+    while (len > 0) {
+        unsigned int index = p->length >> PAGE_SHIFT;
+        size_t offset = p->length & (PAGE_SIZE - 1);
+        size_t n = min_t(size_t, len, PAGE_SIZE - offset);
+
+        if (index == p->nr_pages) {
+            if (p->nr_pages == p->max_pages) {
+                unsigned int max_pages = p->max_pages ? p->max_pages * 2 : 8;
+                struct page **pages = kvmalloc_array(max_pages, sizeof(*pages), GFP_KERNEL);
+
+                if (!pages) {
+                    return -ENOMEM;
+                }
+                if (p->nr_pages) {
+                    memcpy(pages, p->pages, p->nr_pages * sizeof(*pages));
+                }
+                kvfree(p->pages);
+                p->pages = pages;
+                p->max_pages = max_pages;
+            }
+
+            p->pages[p->nr_pages] = alloc_page(GFP_KERNEL);
+            if (!p->pages[p->nr_pages]) {
+                return -ENOMEM;
+            }
+            p->nr_pages++;
+        }
+
+        memcpy(page_address(p->pages[index]) + offset, data, n);
+        p->length += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Turn the pending command into the buffer of a ring entry, which is released with kvfree().
+ * A command that fits in one page is copied out so the page is reused by the next one; a
+ * longer command keeps its pages, mapped contiguously, and vfree() returns them and the array.
+ */
+static const char *aesd_pending_take(struct aesd_pending *p)
+{
+    unsigned int used = DIV_ROUND_UP(p->length, PAGE_SIZE);
+    char *record;
+
+    if (used == 1) {
+        record = kmalloc(p->length, GFP_KERNEL);
+        if (record) {
+            memcpy(record, page_address(p->pages[0]), p->length);
+            p->length = 0;
+        }
+        return record;
+    }
+
+    // Pages past the end are only left over from a failed append
+    while (p->nr_pages > used) {
+        __free_page(p->pages[--p->nr_pages]);
+    }
+
+    record = vmap(p->pages, used, VM_MAP | VM_MAP_PUT_PAGES, PAGE_KERNEL);
+    if (record) {
+        memset(p, 0, sizeof(*p));
+    }
+    return record;
+}
+
+static void aesd_pending_free(struct aesd_pending *p)
+{
+    while (p->nr_pages > 0) {
+        __free_page(p->pages[--p->nr_pages]);
+    }
+    kvfree(p->pages);
+    memset(p, 0, sizeof(*p));
+}
+
+// Add @param len bytes of a write command, ending the command if @param complete
+static int aesd_write_piece(const char *data, size_t len, bool complete)
+{
+    size_t before = pending.length;
+    const char *record;
+    size_t size;
+
+    if (complete && pending.length == 0) {
+        // The whole command is in the staging buffer, copy it straight into its entry
+        char *copy = kmalloc(len, GFP_KERNEL);
+
+        if (!copy) {
+            return -ENOMEM;
+        }
+        memcpy(copy, data, len);
+        aesd_add_record(copy, len);
+        return 0;
+    }
+
+    if (aesd_pending_append(&pending, data, len)) {
+        pending.length = before;
+        return -ENOMEM;
+    }
+    if (!complete) {
+        return 0;
+    }
+
+    size = pending.length;
+    record = aesd_pending_take(&pending);
+    if (!record) {
+        pending.length = before;
+        return -ENOMEM;
+    }
+    aesd_add_record(record, size);
+    return 0;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = 0;
-    char* kbuf = NULL;
+    size_t done = 0;
+    int ret = 0;
+    char *staging = NULL;
 
-    // Allocate memory for the incoming data
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (!kbuf)
+    // Userspace is copied in bounded chunks, a large write needs no large allocation
+    staging = kmalloc(min_t(size_t, count, AESD_STAGING_SIZE), GFP_KERNEL);
+    if (!staging)
     {
         return -ENOMEM;
     }
 
-    // Copy data from user space to kernel space
-    if (copy_from_user(kbuf, buf, count)) {
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
     // Lock the mutex
     if (mutex_lock_interruptible(&aesd_device.mutex)) {
-        kfree(kbuf);
+        kfree(staging);
         return -ERESTARTSYS;
     }
 
-    for (size_t i = 0; i < count; i++)
+    while (done < count && ret == 0)
     {
-        char *new_buffer = krealloc(current_buffer, current_length + 1, GFP_KERNEL);
-        if (!new_buffer) {
-            kfree(kbuf);
-            mutex_unlock(&aesd_device.mutex);
-            return -ENOMEM;
-        }
-
-        current_buffer = new_buffer;
-        current_buffer[current_length] = kbuf[i];
-        current_length++;
-        retval++;
+        size_t chunk = min_t(size_t, count - done, AESD_STAGING_SIZE);
+        size_t pos = 0;
 
-        if (kbuf[i] == '\n')
-        {
-            struct aesd_buffer_entry write_entry = {
-                .buffptr = current_buffer, .size = current_length};
+        if (copy_from_user(staging, buf + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
 
-            aesd_circular_buffer_add_entry(&aesd_buf, &write_entry);
+        while (pos < chunk) {
+            const char *newline = memchr(staging + pos, '\n', chunk - pos);
+            size_t len = newline ? newline - (staging + pos) + 1 : chunk - pos;
 
-            current_buffer = NULL;
-            current_length = 0;
+            ret = aesd_write_piece(staging + pos, len, newline != NULL);
+            if (ret) {
+                break;
+            }
+            pos += len;
         }
+        done += pos;
     }
 
     mutex_unlock(&aesd_device.mutex);
-    kfree(kbuf);
+    kfree(staging);
 
-    return retval;
+    // A failure part way through is reported as a short write
+    return done > 0 ? done : ret;
+}
+
+// Move the history to a ring of @param depth entries; shrinking keeps the most recent ones
+static int aesd_resize_history(uint32_t depth)
+{
+    struct aesd_circular_buffer resized;
+    struct aesd_buffer_entry *entry;
+    size_t offset;
+    int result;
+
+    result = aesd_circular_buffer_init_depth(&resized, depth);
+    if (result) {
+        return result;
+    }
+
+    for (entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_buf, 0, &offset); entry;
+         entry = aesd_circular_buffer_next_entry(&aesd_buf, entry)) {
+        kvfree(aesd_circular_buffer_add_entry(&resized, entry));
+    }
+
+    aesd_circular_buffer_free(&aesd_buf);
+    aesd_buf = resized;
+    history_depth = depth;
+    return 0;
 }
 
 long aesd_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
     struct aesd_seekto seekto;
+    uint32_t depth;
     loff_t new_pos = 0;
     size_t write_cmd_size = 0;
-
-    write_cmd_size = aesd_circular_write_cmd_size(&aesd_buf);
+    long result;
 
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO:
@@ -212,21 +436,42 @@ long aesd_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
                 return -EFAULT;
             }
 
-            // Validate the command and offset
-            if (seekto.write_cmd >= MAX_HISTORY || seekto.write_cmd >= write_cmd_size)
-            {
-                return -EINVAL;
+            if (down_read_interruptible(&aesd_device.history_lock)) {
+                return -ERESTARTSYS;
             }
-            
-            if (aesd_buf.entry[seekto.write_cmd].size < seekto.write_cmd_offset)
+
+            // Validate the command and offset
+            write_cmd_size = aesd_circular_write_cmd_size(&aesd_buf);
+            if (seekto.write_cmd >= write_cmd_size ||
+                aesd_buf.entry[(aesd_buf.out_offs + seekto.write_cmd) & aesd_buf.mask].size < seekto.write_cmd_offset)
             {
+                up_read(&aesd_device.history_lock);
                 return -EINVAL;
             }
 
             // Calculate the new file position based on the command and offset
             new_pos = aesd_circular_calculate_cmd_offset(&aesd_buf, seekto.write_cmd);
             new_pos += seekto.write_cmd_offset;
+            up_read(&aesd_device.history_lock);
             break;
+        case AESDCHAR_IOCSETDEPTH:
+            if (copy_from_user(&depth, (uint32_t __user *) arg, sizeof(depth)))
+            {
+                return -EFAULT;
+            }
+
+            // A rare operation, it simply holds off readers and writers while the entries move
+            if (mutex_lock_interruptible(&aesd_device.mutex)) {
+                return -ERESTARTSYS;
+            }
+            down_write(&aesd_device.history_lock);
+            result = aesd_resize_history(depth);
+            up_write(&aesd_device.history_lock);
+            if (result == 0) {
+                aesd_map_publish(NULL, 0);
+            }
+            mutex_unlock(&aesd_device.mutex);
+            return result;
         default:
             return -ENOTTY;
     }
@@ -236,6 +481,54 @@ long aesd_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 }
 
 
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (!history_map) {
+        return -ENODEV;
+    }
+
+    // The mapping is a view of the history, only write() changes it
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    // Fails for a range past the end of the header page and data area
+    return remap_vmalloc_range(vma, history_map, vma->vm_pgoff);
+}
+
+// Allocate the header page and data area of mmap(), unless history_map_bytes disables it
+static int aesd_map_init(void)
+{
+    struct aesd_mmap_header *header;
+
+    if (history_map_bytes == 0) {
+        return 0;
+    }
+    if (history_map_bytes > AESD_MAX_MAP_BYTES) {
+        return -EINVAL;
+    }
+
+    history_map_size = roundup_pow_of_two(max_t(unsigned long, history_map_bytes, PAGE_SIZE));
+    history_map = vmalloc_user(PAGE_SIZE + history_map_size);
+    if (!history_map) {
+        return -ENOMEM;
+    }
+
+    // vmalloc_user() zeroes the memory, the positions start at 0
+    header = history_map;
+    header->magic = AESD_MMAP_MAGIC;
+    header->version = AESD_MMAP_VERSION;
+    header->data_offset = PAGE_SIZE;
+    header->data_size = history_map_size;
+    header->depth = aesd_buf.depth;
+    return 0;
+}
+
 struct file_operations aesd_fops = {
     .owner          = THIS_MODULE,
     .read           = aesd_read,
@@ -244,6 +537,7 @@ struct file_operations aesd_fops = {
     .release        = aesd_release,
     .llseek         = aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap           = aesd_mmap,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -273,18 +567,34 @@ int aesd_init_module(void)
         return result;
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
+    mutex_init(&aesd_device.mutex);
+    init_rwsem(&aesd_device.history_lock);
+
+    // The history has to exist before the device goes live
+    result = aesd_circular_buffer_init_depth(&aesd_buf, history_depth);
+    if (result) {
+        printk(KERN_ERR "Error %d setting up a history of %u write commands (1 to %u)\n",
+               result, history_depth, AESDCHAR_MAX_HISTORY_DEPTH);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
+    result = aesd_map_init();
+    if (result) {
+        printk(KERN_ERR "Error %d setting up a history map of %u bytes (at most %u)\n",
+               result, history_map_bytes, AESD_MAX_MAP_BYTES);
+        aesd_circular_buffer_free(&aesd_buf);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        vfree(history_map);
+        aesd_circular_buffer_free(&aesd_buf);
         unregister_chrdev_region(dev, 1);
     }
-    
-    aesd_circular_buffer_init(&aesd_buf);
 
     return result;
 
@@ -293,18 +603,18 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
 
     cdev_del(&aesd_device.cdev);
 
-    for (size_t i = 0; i < MAX_HISTORY; i++) {
-        if (aesd_buf.entry[i].buffptr) {
-            kfree(aesd_buf.entry[i].buffptr);
-        }
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_buf, index) {
+        kvfree(entry->buffptr);
     }
+    aesd_circular_buffer_free(&aesd_buf);
 
-    if (current_buffer) {
-        kfree(current_buffer);
-    }
+    aesd_pending_free(&pending);
+    vfree(history_map);
 
     unregister_chrdev_region(devno, 1);
 }
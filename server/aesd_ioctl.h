@@ -33,14 +33,47 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * The first page of an mmap() of the device. The rest of the mapping is a data area of data_size
+ * bytes, a power of two, holding the most recent history as a byte ring: history position p is
+ * stored at data_offset + (p & (data_size - 1)). Positions only grow.
+ *
+ * Positions [max(tail, history_tail), head) are readable. history_tail is the position of file
+ * offset 0 for read(), and anything before tail has been overwritten in the data area. The writer
+ * never takes a lock userspace can see: load head, use the range, then load tail again, and if it
+ * moved past the start of the range the bytes changed meanwhile. generation is bumped after every
+ * write command and depth change.
+ */
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t generation;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t history_tail;
+    /**
+     * The history depth and the write commands currently in it
+     */
+    uint32_t depth;
+    uint32_t count;
+};
+
+#define AESD_MMAP_MAGIC 0x41455344 // "AESD"
+#define AESD_MMAP_VERSION 1
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Change how many write commands the history keeps, passing a pointer to the new uint32_t depth.
+// Growing keeps every command, shrinking keeps the most recent ones.
+#define AESDCHAR_IOCSETDEPTH _IOW(AESD_IOC_MAGIC, 2, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
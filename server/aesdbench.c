@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "server.h"
+#include "metrics.h"
+#include "binary_proto.h"
+
+/**
+ * Load generator for aesdsocket. Every connection runs a closed loop on its
+ * own thread: send one record, optionally split into several writes so the
+ * newline arrives on its own, then wait for the replay that carries it. The
+ * time from the last write to the record showing up in the replay is the
+ * append-to-replay latency. A share of the operations can be
+ * AESDCHAR_IOCSEEKTO commands instead, which both builds answer with the
+ * history from the first record on. Text replies are not framed, so each
+ * seek is followed by AESDSOCKET_STATS and timed until the end of the stats
+ * reply shows up, which also covers a seek the server did not answer. The
+ * server sends the two replies separately, so those reads are acknowledged
+ * right away to keep Nagle on its side from holding back the second one.
+ *
+ * With -P, connections speak the binary protocol instead and keep that many
+ * APPEND requests in flight; latency is then from sending a request to
+ * receiving its response.
+ */
+
+#define BENCH_RECV_SIZE 65536
+#define BENCH_TAG_SIZE 32
+#define APPEND_RESPONSE_SIZE (BINARY_HEADER_SIZE + 8)
+#define SEEKTO_REQUEST "AESDCHAR_IOCSEEKTO:0,0\nAESDSOCKET_STATS\n"
+#define SEEKTO_FENCE_TAG "replay_latency_us "      // Last line of the stats reply
+
+typedef struct bench_config {
+    const char *host;
+    int port;
+    int connections;
+    int duration;
+    size_t record_size;
+    int fragments;
+    int seekto_percent;
+    int full_replays;
+    int pipeline;                   // Binary APPENDs in flight per connection, 0 for the text protocol
+} bench_config_t;
+
+typedef struct bench_worker {
+    pthread_t thread;
+    int id;
+    unsigned long records;
+    unsigned long seektos;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    int failed;
+} bench_worker_t;
+
+static bench_config_t config = {
+    .host = "127.0.0.1",
+    .port = PORT,
+    .connections = 8,
+    .duration = 5,
+    .record_size = 64,
+    .fragments = 1,
+    .seekto_percent = 0,
+    .full_replays = 0,
+    .pipeline = 0
+};
+
+static volatile int stop_flag = 0;
+static histogram_t latency;
+static histogram_t seekto_latency;
+
+static int send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &addr.sin_addr) != 1 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    // Fragments must leave as separate segments, not wait for Nagle
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/**
+ * Receive until @param tag shows up in the stream. The last tag_len - 1 bytes
+ * of each read are carried over in @param window so a tag split across two
+ * reads is still found. With @param quickack every read is acknowledged at
+ * once, so a small reply the server holds back for Nagle is not delayed by
+ * our delayed ACK.
+ */
+static int wait_for_tag(bench_worker_t *worker, int sock, const char *tag, char *window, size_t *window_len,
+                        int quickack) {
+    size_t tag_len = strlen(tag);
+
+    while (1) {
+        // Linux drops out of quick ACK mode on its own, so it is asked for before every read
+        if (quickack) {
+            setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+        }
+        ssize_t received = recv(sock, window + *window_len, BENCH_RECV_SIZE, 0);
+        if (received <= 0) {
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        worker->bytes_received += received;
+
+        size_t len = *window_len + received;
+        int found = memmem(window, len, tag, tag_len) != NULL;
+
+        size_t keep = len < tag_len ? len : tag_len - 1;
+        memmove(window, window + len - keep, keep);
+        *window_len = keep;
+        if (found) {
+            return 0;
+        }
+    }
+}
+
+// Fill @param record with a unique tag followed by padding and a newline
+static size_t build_record(bench_worker_t *worker, char *record, char *tag) {
+    int tag_len = snprintf(tag, BENCH_TAG_SIZE, "b%d.%lu.", worker->id, worker->records);
+    size_t len = config.record_size > (size_t)tag_len + 1 ? config.record_size : (size_t)tag_len + 1;
+
+    memcpy(record, tag, tag_len);
+    memset(record + tag_len, 'x', len - tag_len - 1);
+    record[len - 1] = '\n';
+    return len;
+}
+
+static int recv_exact(int sock, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t received = recv(sock, data, len, 0);
+        if (received <= 0) {
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += received;
+        len -= received;
+    }
+    return 0;
+}
+
+/**
+ * Keep config.pipeline binary APPENDs in flight on @param sock. Whenever
+ * responses come back, the freed slots are refilled with one send().
+ */
+static int run_pipelined(bench_worker_t *worker, int sock) {
+    size_t frame_size = BINARY_HEADER_SIZE + config.record_size + BENCH_TAG_SIZE;
+    char *frames = malloc(config.pipeline * frame_size);
+    char *responses = malloc(config.pipeline * APPEND_RESPONSE_SIZE);
+    uint64_t *sent_at = calloc(config.pipeline, sizeof(uint64_t));
+    char tag[BENCH_TAG_SIZE];
+    char ack[BINARY_MAGIC_LEN];
+    uint32_t next_id = 0, acked = 0;
+    size_t buffered = 0;
+    int ret = -1;
+
+    if (frames == NULL || responses == NULL || sent_at == NULL ||
+        send_all(sock, BINARY_MAGIC, BINARY_MAGIC_LEN) == -1 ||
+        recv_exact(sock, ack, sizeof(ack)) == -1 || memcmp(ack, BINARY_MAGIC, BINARY_MAGIC_LEN) != 0) {
+        goto out;
+    }
+
+    while (!stop_flag) {
+        size_t len = 0;
+        uint64_t now = metrics_now_ns();
+
+        while (next_id - acked < (uint32_t)config.pipeline) {
+            char *frame = frames + len;
+            size_t record_len = build_record(worker, frame + BINARY_HEADER_SIZE, tag);
+            uint32_t value = htobe32(record_len);
+
+            memcpy(frame, &value, 4);
+            value = htobe32(next_id);
+            memcpy(frame + 4, &value, 4);
+            frame[8] = BINARY_APPEND;
+            frame[9] = frame[10] = frame[11] = 0;
+
+            sent_at[next_id % config.pipeline] = now;
+            len += BINARY_HEADER_SIZE + record_len;
+            worker->bytes_sent += BINARY_HEADER_SIZE + record_len;
+            next_id++;
+        }
+        if (len > 0 && send_all(sock, frames, len) == -1) {
+            goto out;
+        }
+
+        ssize_t received = recv(sock, responses + buffered, config.pipeline * APPEND_RESPONSE_SIZE - buffered, 0);
+        if (received <= 0) {
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            goto out;
+        }
+        worker->bytes_received += received;
+        buffered += received;
+        now = metrics_now_ns();
+
+        size_t pos = 0;
+        for (; buffered - pos >= APPEND_RESPONSE_SIZE; pos += APPEND_RESPONSE_SIZE) {
+            uint32_t id;
+            memcpy(&id, responses + pos + 4, 4);
+            id = be32toh(id);
+            if (id != acked || responses[pos + 9] != BINARY_OK) {
+                fprintf(stderr, "Unexpected response %u status %d, expected %u\n", id, responses[pos + 9], acked);
+                goto out;
+            }
+            histogram_record(&latency, now - sent_at[id % config.pipeline]);
+            worker->records++;
+            acked++;
+        }
+        memmove(responses, responses + pos, buffered - pos);
+        buffered -= pos;
+    }
+    ret = 0;
+
+out:
+    free(frames);
+    free(responses);
+    free(sent_at);
+    return ret;
+}
+
+static void *bench_worker(void *arg) {
+    bench_worker_t *worker = arg;
+    unsigned int seed = worker->id * 7919 + 1;
+    char tag[BENCH_TAG_SIZE];
+    char *record = malloc(config.record_size + BENCH_TAG_SIZE);
+    char *window = malloc(BENCH_RECV_SIZE + BENCH_TAG_SIZE);
+    size_t window_len = 0;
+    int sock = connect_server();
+
+    if (record == NULL || window == NULL || sock == -1) {
+        worker->failed = 1;
+        goto out;
+    }
+
+    if (config.pipeline > 0) {
+        worker->failed = run_pipelined(worker, sock) == -1;
+        goto out;
+    }
+
+    if (!config.full_replays) {
+        // Only new history comes back, so replays stay small however long the run
+        char resume[64];
+        int len = snprintf(resume, sizeof(resume), "AESDSOCKET_RESUME:%llu\n", ~0ULL >> 1);
+        if (send_all(sock, resume, len) == -1) {
+            worker->failed = 1;
+            goto out;
+        }
+    }
+
+    while (!stop_flag) {
+        if (config.seekto_percent > 0 && (int)(rand_r(&seed) % 100) < config.seekto_percent) {
+            uint64_t start = metrics_now_ns();
+            if (send_all(sock, SEEKTO_REQUEST, strlen(SEEKTO_REQUEST)) == -1 ||
+                wait_for_tag(worker, sock, SEEKTO_FENCE_TAG, window, &window_len, 1) == -1) {
+                worker->failed = 1;
+                break;
+            }
+            histogram_record(&seekto_latency, metrics_now_ns() - start);
+            worker->seektos++;
+            worker->bytes_sent += strlen(SEEKTO_REQUEST);
+            continue;
+        }
+
+        size_t len = build_record(worker, record, tag);
+        size_t fragment = (len + config.fragments - 1) / config.fragments;
+        uint64_t start = 0;
+
+        for (size_t offset = 0; offset < len; offset += fragment) {
+            size_t piece = len - offset < fragment ? len - offset : fragment;
+            start = metrics_now_ns();
+            if (send_all(sock, record + offset, piece) == -1) {
+                worker->failed = 1;
+                goto out;
+            }
+        }
+        worker->bytes_sent += len;
+
+        if (wait_for_tag(worker, sock, tag, window, &window_len, 0) == -1) {
+            worker->failed = 1;
+            break;
+        }
+        histogram_record(&latency, metrics_now_ns() - start);
+        worker->records++;
+    }
+
+out:
+    if (sock != -1) {
+        close(sock);
+    }
+    free(record);
+    free(window);
+    return NULL;
+}
+
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-t seconds] [-s record_bytes] "
+            "[-f fragments_per_record] [-k seekto_percent] [-F] [-P pipeline_depth]\n"
+            "  -k  share of operations that are timed AESDCHAR_IOCSEEKTO:0,0 requests (text protocol only)\n",
+            program_name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:t:s:f:k:FP:")) != -1) {
+        switch (opt) {
+            case 'H':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 't':
+                config.duration = atoi(optarg);
+                break;
+            case 's':
+                config.record_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                config.fragments = atoi(optarg);
+                break;
+            case 'k':
+                config.seekto_percent = atoi(optarg);
+                break;
+            case 'F':
+                config.full_replays = 1;
+                break;
+            case 'P':
+                config.pipeline = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (config.connections < 1 || config.duration < 1 || config.fragments < 1 ||
+        config.seekto_percent < 0 || config.seekto_percent > 100 || config.pipeline < 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    bench_worker_t *workers = calloc(config.connections, sizeof(bench_worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    uint64_t start = metrics_now_ns();
+    for (int i = 0; i < config.connections; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    sleep(config.duration);
+    stop_flag = 1;
+
+    unsigned long records = 0, seektos = 0, bytes_sent = 0, bytes_received = 0;
+    int failed = 0;
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        records += workers[i].records;
+        seektos += workers[i].seektos;
+        bytes_sent += workers[i].bytes_sent;
+        bytes_received += workers[i].bytes_received;
+        failed += workers[i].failed;
+    }
+    double elapsed = (metrics_now_ns() - start) / 1e9;
+
+    if (config.pipeline > 0) {
+        printf("connections %d, record %zu bytes, binary pipeline of %d, %.1f s\n",
+               config.connections, config.record_size, config.pipeline, elapsed);
+    } else {
+        printf("connections %d, record %zu bytes in %d fragment(s), %d%% seekto, %s replays, %.1f s\n",
+               config.connections, config.record_size, config.fragments, config.seekto_percent,
+               config.full_replays ? "full" : "incremental", elapsed);
+    }
+    printf("records %lu (%.0f/s), seekto %lu, sent %.2f MB/s, received %.2f MB/s\n",
+           records, records / elapsed, seektos, bytes_sent / elapsed / 1e6, bytes_received / elapsed / 1e6);
+    printf("%s latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           config.pipeline > 0 ? "append-to-response" : "append-to-replay",
+           histogram_percentile(&latency, 500) / 1000.0,
+           histogram_percentile(&latency, 990) / 1000.0,
+           histogram_percentile(&latency, 999) / 1000.0,
+           latency.max / 1000.0);
+    if (seektos > 0) {
+        printf("seekto reply latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+               histogram_percentile(&seekto_latency, 500) / 1000.0,
+               histogram_percentile(&seekto_latency, 990) / 1000.0,
+               histogram_percentile(&seekto_latency, 999) / 1000.0,
+               seekto_latency.max / 1000.0);
+    }
+    if (failed) {
+        printf("%d connection(s) failed\n", failed);
+    }
+
+    free(workers);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "aesd_ioctl.h"
+#include "server.h"
+#include "connection.h"
+#include "binary_proto.h"
+#include "history.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define BINARY_INLINE_MAX 1024          // Payloads up to this size go out in the same chunk as their header
+#define BINARY_STATS_SIZE 1024
+#define APPEND_REPLY_SIZE (BINARY_HEADER_SIZE + 8)
+
+typedef struct binary_header {
+    uint32_t length;
+    uint32_t request_id;
+    uint8_t opcode;
+    uint8_t status;
+} binary_header_t;
+
+/**
+ * Binary state, only allocated once a connection negotiates it. Incomplete
+ * frames are buffered the same way line_framer buffers incomplete lines;
+ * APPENDs are collected in appends until a request of another kind, the end
+ * of the received data or a full batch forces them out.
+ */
+typedef struct binary_session {
+    char *buf;
+    size_t start;                       // First buffered byte not handled yet
+    size_t end;
+    size_t cap;
+    struct iovec appends[HISTORY_BATCH_MAX];
+    uint32_t append_ids[HISTORY_BATCH_MAX];
+    int append_count;
+} binary_session_t;
+
+static void encode_header(char *out, uint32_t length, uint32_t request_id, uint8_t opcode, uint8_t status) {
+    uint32_t value = htobe32(length);
+    memcpy(out, &value, 4);
+    value = htobe32(request_id);
+    memcpy(out + 4, &value, 4);
+    out[8] = opcode;
+    out[9] = status;
+    out[10] = out[11] = 0;
+}
+
+static void decode_header(const char *in, binary_header_t *header) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+    header->length = be32toh(value);
+    memcpy(&value, in + 4, 4);
+    header->request_id = be32toh(value);
+    header->opcode = in[8];
+    header->status = in[9];
+}
+
+static uint32_t decode_u32(const char *in) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return be32toh(value);
+}
+
+static void encode_u64(char *out, uint64_t value) {
+    value = htobe64(value);
+    memcpy(out, &value, 8);
+}
+
+static uint64_t decode_u64(const char *in) {
+    uint64_t value;
+    memcpy(&value, in, 8);
+    return be64toh(value);
+}
+
+/**
+ * Queue a response whose payload is @param prefix followed by @param data.
+ * Small payloads are copied behind the header so the response is one chunk.
+ * When @param data is NULL, only the header and prefix are queued, announcing
+ * @param len more bytes the caller queues next.
+ */
+static int send_response(client_conn_t *conn, const binary_header_t *request, uint8_t status,
+                         const char *prefix, size_t prefix_len, const char *data, size_t len) {
+    char frame[BINARY_HEADER_SIZE + BINARY_INLINE_MAX];
+    size_t frame_len = BINARY_HEADER_SIZE + prefix_len;
+
+    encode_header(frame, prefix_len + len, request->request_id, request->opcode, status);
+    if (prefix_len > 0) {
+        memcpy(frame + BINARY_HEADER_SIZE, prefix, prefix_len);
+    }
+    if (data != NULL && prefix_len + len <= BINARY_INLINE_MAX) {
+        memcpy(frame + frame_len, data, len);
+        frame_len += len;
+        data = NULL;
+    }
+
+    if (conn_send(conn, frame, frame_len) == -1) {
+        return -1;
+    }
+    return data != NULL ? conn_send(conn, data, len) : 0;
+}
+
+static int send_status(client_conn_t *conn, const binary_header_t *request, uint8_t status) {
+    return send_response(conn, request, status, NULL, 0, NULL, 0);
+}
+
+// Store every collected APPEND with one group commit and answer them together
+static int flush_appends(client_conn_t *conn) {
+    binary_session_t *session = conn->binary;
+    int count = session->append_count;
+    off_t ends[HISTORY_BATCH_MAX];
+    char replies[HISTORY_BATCH_MAX * APPEND_REPLY_SIZE];
+
+    if (count == 0) {
+        return 0;
+    }
+    session->append_count = 0;
+
+    uint64_t start = metrics_now_ns();
+    int ret = history_appendv(conn->file_fd, session->appends, count, ends);
+    histogram_record(&metrics.append_latency, metrics_now_ns() - start);
+    if (ret == 0) {
+        conn_publish();
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *reply = replies + i * APPEND_REPLY_SIZE;
+        encode_header(reply, 8, session->append_ids[i], BINARY_APPEND, ret == 0 ? BINARY_OK : BINARY_EIO);
+        encode_u64(reply + BINARY_HEADER_SIZE, ret == 0 ? (uint64_t)ends[i] : 0);
+    }
+    if (ret == 0) {
+        METRIC_ADD(records_appended, count);
+    }
+
+    return conn_send(conn, replies, count * APPEND_REPLY_SIZE);
+}
+
+static int handle_append(client_conn_t *conn, const binary_header_t *header, const char *payload) {
+    binary_session_t *session = conn->binary;
+
+    if (header->length == 0) {
+        if (flush_appends(conn) == -1) {
+            return -1;
+        }
+        return send_status(conn, header, BINARY_EINVAL);
+    }
+
+    if (session->append_count == HISTORY_BATCH_MAX && flush_appends(conn) == -1) {
+        return -1;
+    }
+
+    // The payload stays valid until binary_feed() returns, which flushes first
+    session->appends[session->append_count].iov_base = (void *)payload;
+    session->appends[session->append_count].iov_len = header->length;
+    session->append_ids[session->append_count] = header->request_id;
+    session->append_count++;
+    return 0;
+}
+
+static int handle_seekto(client_conn_t *conn, const binary_header_t *header, const char *payload) {
+    if (header->length != 8) {
+        return send_status(conn, header, BINARY_EINVAL);
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    struct aesd_seekto seekto = {
+        .write_cmd = decode_u32(payload),
+        .write_cmd_offset = decode_u32(payload + 4)
+    };
+
+    if (ioctl(conn->file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        log_msg(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
+        return send_status(conn, header, BINARY_EINVAL);
+    }
+
+    size_t len;
+    char *content = read_to_end(conn->file_fd, NULL, &len);
+    if (content == NULL) {
+        return send_status(conn, header, BINARY_EIO);
+    }
+    if (len > BINARY_MAX_RESPONSE) {
+        len = BINARY_MAX_RESPONSE;
+    }
+
+    int ret = send_response(conn, header, BINARY_OK, NULL, 0, content, len);
+    free(content);
+    return ret;
+#else
+    history_snapshot_t snapshot;
+    off_t offset;
+
+    if (history_find_record(decode_u32(payload), decode_u32(payload + 4), &offset) == -1) {
+        return send_status(conn, header, errno == EINVAL ? BINARY_EINVAL : BINARY_EIO);
+    }
+
+    history_snapshot(&snapshot);
+    if (offset > snapshot.length) {
+        offset = snapshot.length;
+    }
+    // The frame length is 32 bits, a longer history is cut like a READ_RANGE
+    off_t len = snapshot.length - offset;
+    if (len > (off_t)BINARY_MAX_RESPONSE) {
+        len = BINARY_MAX_RESPONSE;
+    }
+    int ret = send_response(conn, header, BINARY_OK, NULL, 0, NULL, len);
+    if (ret == 0 && len > 0) {
+        ret = conn_send_file(conn, offset, len);
+    }
+    return ret;
+#endif
+}
+
+// Clip [offset, offset + max_len) to the history in [window_start, committed) and to what one frame carries
+static void clip_range(uint64_t offset, uint64_t max_len, off_t window_start, off_t committed,
+                       off_t *start, off_t *end) {
+    *start = window_start;
+    if (offset > (uint64_t)committed) {
+        *start = committed;
+    } else if (offset > (uint64_t)window_start) {
+        *start = offset;
+    }
+
+    *end = committed;
+    if (max_len != 0 && max_len < (uint64_t)(*end - *start)) {
+        *end = *start + max_len;
+    }
+    // The client reads on from *end, so the range just comes back short
+    if (*end - *start > (off_t)BINARY_MAX_RESPONSE) {
+        *end = *start + BINARY_MAX_RESPONSE;
+    }
+}
+
+static int handle_read_range(client_conn_t *conn, const binary_header_t *header, const char *payload) {
+    history_snapshot_t snapshot;
+    char prefix[8];
+    off_t start, end;
+    int ret;
+
+    if (header->length != 16) {
+        return send_status(conn, header, BINARY_EINVAL);
+    }
+    uint64_t offset = decode_u64(payload);
+    uint64_t max_len = decode_u64(payload + 8);
+    uint64_t began = metrics_now_ns();
+
+#ifdef USE_AESD_CHAR_DEVICE
+    history_view_t *view = history_view_acquire(conn->file_fd);
+    if (view == NULL) {
+        return send_status(conn, header, BINARY_EIO);
+    }
+    snapshot = view->snapshot;
+
+    // The ring only holds the newest bytes, a range before them starts at the oldest one left
+    off_t window_start = snapshot.length - (off_t)view->len;
+    clip_range(offset, max_len, window_start, snapshot.length, &start, &end);
+    encode_u64(prefix, start);
+    if (sizeof(prefix) + (end - start) <= BINARY_INLINE_MAX) {
+        ret = send_response(conn, header, BINARY_OK, prefix, sizeof(prefix),
+                            view->data + (start - window_start), end - start);
+        history_view_release(view);
+    } else {
+        // A large range is queued straight from the view shared with other replays
+        ret = send_response(conn, header, BINARY_OK, prefix, sizeof(prefix), NULL, end - start);
+        if (ret == 0) {
+            ret = conn_send_view(conn, view, start - window_start, end - start);
+        } else {
+            history_view_release(view);
+        }
+    }
+#else
+    history_snapshot(&snapshot);
+    clip_range(offset, max_len, segment_log_start(), snapshot.length, &start, &end);
+    encode_u64(prefix, start);
+
+    // Only the header is copied, the range follows straight from the file with sendfile()
+    ret = send_response(conn, header, BINARY_OK, prefix, sizeof(prefix), NULL, end - start);
+    if (ret == 0 && end > start) {
+        ret = conn_send_file(conn, start, end - start);
+    }
+#endif
+
+    histogram_record(&metrics.replay_latency, metrics_now_ns() - began);
+    METRIC_ADD(replays_served, 1);
+    return ret;
+}
+
+static int handle_stats(client_conn_t *conn, const binary_header_t *header) {
+    char reply[BINARY_STATS_SIZE];
+    size_t len = metrics_format(reply, sizeof(reply));
+
+    return send_response(conn, header, BINARY_OK, NULL, 0, reply, len);
+}
+
+static int handle_frame(client_conn_t *conn, const binary_header_t *header, const char *payload) {
+    if (header->opcode == BINARY_APPEND) {
+        return handle_append(conn, header, payload);
+    }
+
+    // APPENDs received before this request are stored and answered first to keep responses in order
+    if (flush_appends(conn) == -1) {
+        return -1;
+    }
+
+    switch (header->opcode) {
+        case BINARY_SEEKTO:
+            return handle_seekto(conn, header, payload);
+        case BINARY_READ_RANGE:
+            return handle_read_range(conn, header, payload);
+        case BINARY_STATS:
+            return handle_stats(conn, header);
+        default:
+            return send_status(conn, header, BINARY_EINVAL);
+    }
+}
+
+static int buffer_append(binary_session_t *session, const char *data, size_t len) {
+    if (session->end + len > session->cap) {
+        size_t new_cap = session->cap ? session->cap : BUFFER_SIZE;
+        while (new_cap < session->end + len) {
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(session->buf, new_cap);
+        if (new_buf == NULL) {
+            log_msg(LOG_ERR, "Failed to grow frame buffer: %s", strerror(errno));
+            return -1;
+        }
+        session->buf = new_buf;
+        session->cap = new_cap;
+    }
+
+    memcpy(session->buf + session->end, data, len);
+    session->end += len;
+    return 0;
+}
+
+// Handle every complete frame of data; @param consumed receives the bytes they took
+static int split_frames(client_conn_t *conn, const char *data, size_t len, size_t *consumed) {
+    binary_header_t header;
+    size_t pos = 0;
+    int ret = 0;
+
+    while (len - pos >= BINARY_HEADER_SIZE) {
+        decode_header(data + pos, &header);
+        if (header.length > BINARY_MAX_PAYLOAD) {
+            log_msg(LOG_WARNING, "Closing socket_id:%d, frame of %u bytes exceeds the limit",
+                    conn->client_socket, header.length);
+            ret = -1;
+            break;
+        }
+        if (len - pos - BINARY_HEADER_SIZE < header.length) {
+            break;
+        }
+        if (handle_frame(conn, &header, data + pos + BINARY_HEADER_SIZE) == -1) {
+            ret = -1;
+            break;
+        }
+        pos += BINARY_HEADER_SIZE + header.length;
+    }
+
+    *consumed = pos;
+    if (ret == -1) {
+        return -1;
+    }
+    return flush_appends(conn);
+}
+
+int binary_start(client_conn_t *conn) {
+    conn->binary = calloc(1, sizeof(binary_session_t));
+    if (conn->binary == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate binary session: %s", strerror(errno));
+        return -1;
+    }
+
+    log_msg(LOG_DEBUG, "socket_id:%d switched to binary framing", conn->client_socket);
+    return conn_send(conn, BINARY_MAGIC, BINARY_MAGIC_LEN);
+}
+
+int binary_feed(client_conn_t *conn, const char *data, size_t len) {
+    binary_session_t *session = conn->binary;
+    size_t consumed;
+
+    if (session->start == session->end) {
+        // Nothing buffered: handle frames in place and keep only the incomplete tail
+        session->start = session->end = 0;
+        if (split_frames(conn, data, len, &consumed) == -1) {
+            return -1;
+        }
+        return buffer_append(session, data + consumed, len - consumed);
+    }
+
+    // Payloads handed out by the previous call are no longer referenced, so compact now
+    size_t buffered = session->end - session->start;
+    memmove(session->buf, session->buf + session->start, buffered);
+    session->start = 0;
+    session->end = buffered;
+
+    if (buffer_append(session, data, len) == -1) {
+        return -1;
+    }
+
+    int ret = split_frames(conn, session->buf, session->end, &consumed);
+    session->start = consumed;
+    return ret;
+}
+
+void binary_free(client_conn_t *conn) {
+    if (conn->binary != NULL) {
+        free(conn->binary->buf);
+        free(conn->binary);
+        conn->binary = NULL;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef BINARY_PROTO_H
+#define BINARY_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct client_conn;
+
+/**
+ * Length-prefixed binary framing, negotiated per connection on the same port
+ * as the text protocol: a client that opens with the BINARY_MAGIC preamble
+ * gets it echoed back and from then on speaks frames instead of lines.
+ *
+ * Every frame, request or response, is a BINARY_HEADER_SIZE header followed
+ * by length payload bytes; all integers are big endian:
+ *
+ *      uint32 length       payload bytes after the header
+ *      uint32 request_id   chosen by the client, echoed in the response
+ *      uint8  opcode       BINARY_APPEND ... BINARY_STATS
+ *      uint8  status       0 in requests, a binary_status_t in responses
+ *      uint16 reserved     0
+ *
+ * Requests may be pipelined without waiting for responses; each one gets
+ * exactly one response and responses come back in request order.
+ */
+#define BINARY_MAGIC "AESDBIN1"
+#define BINARY_MAGIC_LEN 8
+#define BINARY_HEADER_SIZE 12
+#define BINARY_MAX_PAYLOAD (16 * 1024 * 1024)
+#define BINARY_MAX_RESPONSE (UINT32_MAX - 8)   // History bytes per response, READ_RANGE's offset prefix included fits length
+
+typedef enum {
+    BINARY_APPEND = 1,          // Payload is stored as is; response: uint64 history offset just past it
+    BINARY_SEEKTO = 2,          // Payload: uint32 write_cmd, uint32 write_cmd_offset;
+                                // response: the history from that position on, at most BINARY_MAX_RESPONSE bytes
+    BINARY_READ_RANGE = 3,      // Payload: uint64 offset, uint64 max length, 0 for all;
+                                // response: uint64 offset of the first byte returned, then the bytes;
+                                // a range longer than BINARY_MAX_RESPONSE comes back short, read on from its end
+    BINARY_STATS = 4            // Response: the AESDSOCKET_STATS text
+} binary_opcode_t;
+
+typedef enum {
+    BINARY_OK = 0,
+    BINARY_EINVAL = 1,          // Unknown opcode or malformed payload
+    BINARY_ENOTSUP = 2,         // Not available with this FILE_PATH
+    BINARY_EIO = 3              // Storing or reading the history failed
+} binary_status_t;
+
+/**
+ * Switch @param conn to binary framing after its preamble was received and
+ * acknowledge it.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int binary_start(struct client_conn *conn);
+
+/**
+ * Handle @param len bytes received on a binary connection. Frames may span
+ * several calls; consecutive APPENDs are stored with one group commit and
+ * their responses queued together.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int binary_feed(struct client_conn *conn, const char *data, size_t len);
+
+/**
+ * Release the binary state of @param conn, if any.
+ */
+void binary_free(struct client_conn *conn);
+
+#endif /* BINARY_PROTO_H */
@@ -0,0 +1,890 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include "aesd_ioctl.h"
+#include "server.h"
+#include "connection.h"
+#include "history.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define RESUME_PREFIX "AESDSOCKET_RESUME:"
+#define STATS_COMMAND "AESDSOCKET_STATS"
+#define SUBSCRIBE_COMMAND "AESDSOCKET_SUBSCRIBE"
+#define STATS_REPLY_SIZE 1024
+
+size_t out_high_water = 0;
+overflow_policy_t out_overflow_policy = OVERFLOW_DISCONNECT;
+unsigned long idle_timeout_ms = 0;
+unsigned long evict_timeout_ms = 0;
+
+// Every open connection, so a handoff can reach them whichever engine serves them
+static LIST_HEAD(live_list, client_conn) live_conns = LIST_HEAD_INITIALIZER(live_conns);
+static pthread_mutex_t live_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_empty = PTHREAD_COND_INITIALIZER;
+
+// Connections following new records, signalled by conn_publish()
+static LIST_HEAD(subscriber_list, client_conn) subscriber_list = LIST_HEAD_INITIALIZER(subscriber_list);
+static pthread_mutex_t subscriber_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long subscriber_count = 0;
+static unsigned long published_generation = 0;
+
+// Copy a line starting with @param prefix into @param command as a C string
+static int command_text(const char *prefix, const char *data, size_t len, char *command, size_t size) {
+    size_t prefix_len = strlen(prefix);
+
+    if (len < prefix_len || memcmp(data, prefix, prefix_len) != 0) {
+        return 0;
+    }
+
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(command, data, len);
+    command[len] = '\0';
+    return 1;
+}
+
+// Helper function to parse the AESDCHAR_IOCSEEKTO command
+static int parse_seekto_command(const char *data, size_t len, unsigned int *write_cmd, unsigned int *write_cmd_offset) {
+    char command[64];
+
+    return command_text(SEEKTO_PREFIX, data, len, command, sizeof(command)) &&
+           sscanf(command, SEEKTO_PREFIX "%u,%u", write_cmd, write_cmd_offset) == 2;
+}
+
+// Helper function to parse the AESDSOCKET_RESUME command
+static int parse_resume_command(const char *data, size_t len, unsigned long long *offset) {
+    char command[64];
+
+    return command_text(RESUME_PREFIX, data, len, command, sizeof(command)) &&
+           sscanf(command, RESUME_PREFIX "%llu", offset) == 1;
+}
+
+// Runs on the timer thread: the socket is only shut down, the serving thread does the rest
+static void evict(client_conn_t *conn) {
+    __atomic_store_n(&conn->evicted, 1, __ATOMIC_RELAXED);
+    shutdown(conn->client_socket, SHUT_RDWR);
+}
+
+// The engine reads end of input next and closes once the queued replies are out
+static void stop_reading(client_conn_t *conn) {
+    __atomic_store_n(&conn->evicted, 1, __ATOMIC_RELAXED);
+    shutdown(conn->client_socket, SHUT_RD);
+}
+
+// Activity is recorded with a plain store; the idle timer only checks it when it fires
+static void touch(client_conn_t *conn) {
+    if (idle_timeout_ms != 0) {
+        __atomic_store_n(&conn->last_active_ms, timer_now_ms(), __ATOMIC_RELAXED);
+    }
+}
+
+static void idle_expired(void *arg) {
+    client_conn_t *conn = (client_conn_t*)arg;
+    uint64_t idle_ms = timer_now_ms() - __atomic_load_n(&conn->last_active_ms, __ATOMIC_RELAXED);
+
+    if (idle_ms < idle_timeout_ms) {
+        timer_arm(&conn->idle_timer, idle_timeout_ms - idle_ms);
+        return;
+    }
+    // A subscriber waits for records, however long that takes
+    if (__atomic_load_n(&conn->notify_fd, __ATOMIC_RELAXED) != -1) {
+        timer_arm(&conn->idle_timer, idle_timeout_ms);
+        return;
+    }
+
+    log_msg(LOG_INFO, "Closing socket_id:%d after %lu ms idle", conn->client_socket, (unsigned long)idle_ms);
+    evict(conn);
+}
+
+static void evict_expired(void *arg) {
+    client_conn_t *conn = (client_conn_t*)arg;
+
+    log_msg(LOG_WARNING, "Evicting slow socket_id:%d, replies not drained within %lu ms", conn->client_socket, evict_timeout_ms);
+    evict(conn);
+}
+
+static void arm_evict_timer(client_conn_t *conn) {
+    if (evict_timeout_ms != 0 && !conn->evict_armed) {
+        conn->evict_armed = 1;
+        timer_arm(&conn->evict_timer, evict_timeout_ms);
+    }
+}
+
+static void cancel_evict_timer(client_conn_t *conn) {
+    if (conn->evict_armed) {
+        conn->evict_armed = 0;
+        timer_cancel(&conn->evict_timer);
+    }
+}
+
+static void free_chunk(out_chunk_t *chunk) {
+    if (chunk->segment != NULL) {
+        segment_release(chunk->segment);
+    }
+    if (chunk->view != NULL) {
+        history_view_release(chunk->view);
+    }
+    free(chunk);
+}
+
+client_conn_t *conn_create(int client_socket, const struct sockaddr_in *client_addr) {
+    client_conn_t *conn = calloc(1, sizeof(client_conn_t));
+    if (conn == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate memory for connection: %s", strerror(errno));
+        close(client_socket);
+        return NULL;
+    }
+
+    conn->client_socket = client_socket;
+    conn->client_addr = *client_addr;
+    conn->notify_fd = -1;
+    STAILQ_INIT(&conn->out_queue);
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr->sin_addr, addr, sizeof(addr));
+    log_msg(LOG_INFO, "Accepted connection from %s and socket_id:%d", addr, client_socket);
+
+    int flags = fcntl(client_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_msg(LOG_ERR, "Failed to make socket non-blocking: %s", strerror(errno));
+        close(client_socket);
+        free(conn);
+        return NULL;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    conn->file_fd = open(FILE_PATH, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (conn->file_fd == -1) {
+        log_msg(LOG_ERR, "Failed to open file: %s", strerror(errno));
+        close(client_socket);
+        free(conn);
+        return NULL;
+    }
+#else
+    // Appends and replays go through the segment log, which owns the files
+    conn->file_fd = -1;
+#endif
+
+    timer_init(&conn->idle_timer, idle_expired, conn);
+    timer_init(&conn->evict_timer, evict_expired, conn);
+    if (idle_timeout_ms != 0) {
+        touch(conn);
+        timer_arm(&conn->idle_timer, idle_timeout_ms);
+    }
+
+    pthread_mutex_lock(&live_mutex);
+    LIST_INSERT_HEAD(&live_conns, conn, live);
+    pthread_mutex_unlock(&live_mutex);
+
+    METRIC_ADD(connections, 1);
+    METRIC_ADD(active_connections, 1);
+    return conn;
+}
+
+void conn_destroy(client_conn_t *conn) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn->client_addr.sin_addr, addr, sizeof(addr));
+    log_msg(LOG_INFO, "Closed connection from %s and socket_id:%d", addr, conn->client_socket);
+
+    // Waits out a callback that is about to shut the socket down
+    timer_cancel(&conn->idle_timer);
+    timer_cancel(&conn->evict_timer);
+
+    while (!STAILQ_EMPTY(&conn->out_queue)) {
+        out_chunk_t *chunk = STAILQ_FIRST(&conn->out_queue);
+        STAILQ_REMOVE_HEAD(&conn->out_queue, entries);
+        free_chunk(chunk);
+    }
+    METRIC_SUB(active_connections, 1);
+
+    framer_free(&conn->framer);
+    binary_free(conn);
+
+    if (conn->notify_fd != -1) {
+        pthread_mutex_lock(&subscriber_mutex);
+        LIST_REMOVE(conn, subscribers);
+        subscriber_count--;
+        pthread_mutex_unlock(&subscriber_mutex);
+        close(conn->notify_fd);
+        METRIC_SUB(subscribers, 1);
+    }
+
+    // Unlisted before the socket is closed, a drain never shuts down a reused descriptor
+    pthread_mutex_lock(&live_mutex);
+    LIST_REMOVE(conn, live);
+    if (LIST_EMPTY(&live_conns)) {
+        pthread_cond_broadcast(&live_empty);
+    }
+    pthread_mutex_unlock(&live_mutex);
+
+    close(conn->client_socket);
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+    }
+    free(conn);
+}
+
+void conn_drain_all(void) {
+    client_conn_t *conn;
+
+    pthread_mutex_lock(&live_mutex);
+    LIST_FOREACH(conn, &live_conns, live) {
+        // A connection that has not spoken yet may have its first request on the way
+        if (__atomic_load_n(&conn->spoke, __ATOMIC_RELAXED)) {
+            stop_reading(conn);
+        }
+    }
+    pthread_mutex_unlock(&live_mutex);
+}
+
+void conn_abort_all(void) {
+    client_conn_t *conn;
+
+    pthread_mutex_lock(&live_mutex);
+    LIST_FOREACH(conn, &live_conns, live) {
+        evict(conn);
+    }
+    pthread_mutex_unlock(&live_mutex);
+}
+
+void conn_wait_all_closed(void) {
+    pthread_mutex_lock(&live_mutex);
+    while (!LIST_EMPTY(&live_conns)) {
+        pthread_cond_wait(&live_empty, &live_mutex);
+    }
+    pthread_mutex_unlock(&live_mutex);
+}
+
+// Write out the rest of @param chunk: 0 when it is fully sent, 1 if the socket would block, -1 on error
+static int transmit_chunk(client_conn_t *conn, out_chunk_t *chunk) {
+    while (chunk->sent < chunk->len) {
+        ssize_t sent;
+
+        if (chunk->data != NULL) {
+            sent = send(conn->client_socket, chunk->data + chunk->sent, chunk->len - chunk->sent, MSG_NOSIGNAL);
+        } else {
+            off_t offset = chunk->offset + chunk->sent;
+            sent = sendfile(conn->client_socket, segment_fd(chunk->segment), &offset, chunk->len - chunk->sent);
+        }
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            // The file ended before the snapshot length, it must have been truncated
+            log_msg(LOG_ERR, "Short sendfile on socket_id:%d", conn->client_socket);
+            return -1;
+        }
+
+        chunk->sent += sent;
+        METRIC_ADD(bytes_out, sent);
+        METRIC_ADD(send_calls, 1);
+        touch(conn);
+    }
+
+    return 0;
+}
+
+/**
+ * Send or queue one reply. A reference on @param segment or @param view
+ * passes to the queued chunk, or is dropped here if the reply went out in
+ * full, was dropped or failed.
+ */
+static int queue_reply(client_conn_t *conn, const char *data, log_segment_t *segment, history_view_t *view,
+                       off_t offset, size_t len) {
+    out_chunk_t direct = { .data = data, .segment = segment, .view = view, .offset = offset, .len = len };
+    int ret = 0;
+
+    if (STAILQ_EMPTY(&conn->out_queue)) {
+        // Nothing is queued, so the reply can go straight to the socket
+        if (!conn->async_send && (ret = transmit_chunk(conn, &direct)) != 1) {
+            goto done;
+        }
+        ret = 0;
+    } else if (out_high_water != 0 && conn->out_pending + len > out_high_water) {
+        // Only a client that is already behind is limited, a reply to an idle socket always goes out
+        // A binary stream cannot lose part of a response, so it is always disconnected
+        if (out_overflow_policy == OVERFLOW_DROP && conn->protocol != PROTOCOL_BINARY) {
+            log_msg(LOG_WARNING, "Dropping %zu byte reply to slow socket_id:%d", len, conn->client_socket);
+            goto done;
+        }
+        log_msg(LOG_WARNING, "Disconnecting slow socket_id:%d with %zu bytes queued", conn->client_socket, conn->out_pending);
+        ret = -1;
+        goto done;
+    }
+
+    // A view is immutable and shared, only other data is copied behind the chunk
+    size_t remaining = len - direct.sent;
+    int copy = data != NULL && view == NULL;
+    out_chunk_t *chunk = malloc(sizeof(out_chunk_t) + (copy ? remaining : 0));
+    if (chunk == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate memory for outbound chunk: %s", strerror(errno));
+        ret = -1;
+        goto done;
+    }
+
+    if (copy) {
+        memcpy(chunk + 1, data + direct.sent, remaining);
+        chunk->data = (const char *)(chunk + 1);
+    } else if (data != NULL) {
+        chunk->data = data + direct.sent;
+    } else {
+        chunk->data = NULL;
+        chunk->offset = offset + direct.sent;
+    }
+    chunk->segment = segment;
+    chunk->view = view;
+    chunk->len = remaining;
+    chunk->sent = 0;
+
+    STAILQ_INSERT_TAIL(&conn->out_queue, chunk, entries);
+    conn->out_pending += remaining;
+    // The deadline runs from the first reply the socket could not take
+    arm_evict_timer(conn);
+    return 0;
+
+done:
+    if (segment != NULL) {
+        segment_release(segment);
+    }
+    if (view != NULL) {
+        history_view_release(view);
+    }
+    return ret;
+}
+
+int conn_send(client_conn_t *conn, const char *data, size_t len) {
+    return queue_reply(conn, data, NULL, NULL, 0, len);
+}
+
+int conn_send_view(client_conn_t *conn, history_view_t *view, size_t start, size_t len) {
+    return queue_reply(conn, view->data + start, NULL, view, 0, len);
+}
+
+int conn_send_file(client_conn_t *conn, off_t offset, size_t len) {
+    while (len > 0) {
+        off_t file_offset;
+        size_t avail;
+        log_segment_t *segment = segment_acquire(offset, &file_offset, &avail);
+
+        if (segment == NULL) {
+            log_msg(LOG_ERR, "History at offset %lld for socket_id:%d is no longer retained",
+                    (long long)offset, conn->client_socket);
+            return -1;
+        }
+
+        // A range crossing into the next segment continues in a chunk of its own
+        size_t part = len < avail ? len : avail;
+        if (queue_reply(conn, NULL, segment, NULL, file_offset, part) == -1) {
+            return -1;
+        }
+        offset += part;
+        len -= part;
+    }
+    return 0;
+}
+
+void conn_log_send_stats(void) {
+    unsigned long bytes = METRIC_GET(bytes_out);
+    unsigned long syscalls = METRIC_GET(send_calls);
+
+    log_msg(LOG_INFO, "Sent %lu bytes to clients in %lu syscalls (%lu bytes/syscall)",
+           bytes, syscalls, syscalls ? bytes / syscalls : 0);
+}
+
+static int handle_seekto(client_conn_t *conn, unsigned int write_cmd, unsigned int write_cmd_offset) {
+#ifdef USE_AESD_CHAR_DEVICE
+    struct aesd_seekto seekto = {
+        .write_cmd = write_cmd,
+        .write_cmd_offset = write_cmd_offset
+    };
+
+    if (ioctl(conn->file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        log_msg(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
+        return 0;
+    }
+
+    // Read the content of the device from the new position and send it back over the socket
+    size_t len;
+    char *content = read_to_end(conn->file_fd, NULL, &len);
+    if (content == NULL) {
+        return -1;
+    }
+
+    int ret = conn_send(conn, content, len);
+    free(content);
+    return ret;
+#else
+    // The record index turns the seek into a file range, sent like a replay
+    history_snapshot_t snapshot;
+    off_t offset;
+
+    if (history_find_record(write_cmd, write_cmd_offset, &offset) == -1) {
+        log_msg(LOG_ERR, "Failed to seek to record %u offset %u: %s", write_cmd, write_cmd_offset, strerror(errno));
+        return 0;
+    }
+
+    history_snapshot(&snapshot);
+    if (snapshot.length <= offset) {
+        return 0;
+    }
+    return conn_send_file(conn, offset, snapshot.length - offset);
+#endif
+}
+
+/**
+ * Queue a replay of the history, or in resume mode only of what was committed
+ * after the client's cursor, then move the cursor to the end of the snapshot.
+ * The snapshot is read without taking file_mutex.
+ */
+static int queue_replay(client_conn_t *conn) {
+    history_snapshot_t snapshot;
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // Concurrent replays of the same generation send from one shared copy of the ring
+    history_view_t *view = history_view_acquire(conn->file_fd);
+    if (view == NULL) {
+        return -1;
+    }
+    snapshot = view->snapshot;
+
+    // The ring only holds the newest bytes; anything the cursor points before was evicted
+    size_t skip = 0;
+    if (conn->resume) {
+        off_t window_start = snapshot.length - (off_t)view->len;
+        if (conn->cursor > window_start) {
+            skip = conn->cursor - window_start;
+            if (skip > view->len) {
+                skip = view->len;
+            }
+        }
+        conn->cursor = snapshot.length;
+    }
+
+    if (view->len == skip) {
+        history_view_release(view);
+        return 0;
+    }
+    return conn_send_view(conn, view, skip, view->len - skip);
+#else
+    // The log is append only, so the committed length is a stable snapshot
+    off_t start = segment_log_start();
+    history_snapshot(&snapshot);
+
+    // Like the ring, retention may have dropped what the cursor points at
+    if (conn->resume) {
+        if (conn->cursor > start) {
+            start = conn->cursor < snapshot.length ? conn->cursor : snapshot.length;
+        }
+        conn->cursor = snapshot.length;
+    }
+
+    if (snapshot.length == start) {
+        return 0;
+    }
+    return conn_send_file(conn, start, snapshot.length - start);
+#endif
+}
+
+static int replay_history(client_conn_t *conn) {
+    uint64_t start = metrics_now_ns();
+    int ret = queue_replay(conn);
+
+    histogram_record(&metrics.replay_latency, metrics_now_ns() - start);
+    METRIC_ADD(replays_served, 1);
+    return ret;
+}
+
+/**
+ * Queue what a subscriber has not received yet, unless earlier replies still
+ * wait for the socket. A subscriber that shut down its side only gets what
+ * is queued already, so it closes like any other connection.
+ */
+static int push_records(client_conn_t *conn) {
+    history_snapshot_t snapshot;
+
+    if (conn->out_pending > 0 || conn->read_closed) {
+        return 0;
+    }
+    history_snapshot(&snapshot);
+    if (snapshot.length <= conn->cursor) {
+        return 0;
+    }
+
+    METRIC_ADD(pushes, 1);
+    return queue_replay(conn);
+}
+
+static int subscribe(client_conn_t *conn) {
+    history_snapshot_t snapshot;
+
+    if (conn->notify_fd != -1) {
+        return 0;
+    }
+
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create subscriber eventfd: %s", strerror(errno));
+        return -1;
+    }
+    __atomic_store_n(&conn->notify_fd, notify_fd, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&subscriber_mutex);
+    LIST_INSERT_HEAD(&subscriber_list, conn, subscribers);
+    __atomic_add_fetch(&subscriber_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&subscriber_mutex);
+    METRIC_ADD(subscribers, 1);
+
+    // Listed before the history is looked at, so a commit is either seen here or signalled
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!conn->resume) {
+        history_snapshot(&snapshot);
+        conn->resume = 1;
+        conn->cursor = snapshot.length;
+    }
+
+    log_msg(LOG_INFO, "socket_id:%d subscribed at offset %lld", conn->client_socket, (long long)conn->cursor);
+    // A resumed cursor may be behind already
+    return push_records(conn);
+}
+
+void conn_publish(void) {
+    history_snapshot_t snapshot;
+    client_conn_t *conn;
+
+    // Whoever publishes a generation first covers the commits before it
+    history_snapshot(&snapshot);
+    unsigned long last = __atomic_load_n(&published_generation, __ATOMIC_RELAXED);
+    do {
+        if (snapshot.generation <= last) {
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&published_generation, &last, snapshot.generation, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&subscriber_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&subscriber_mutex);
+    LIST_FOREACH(conn, &subscriber_list, subscribers) {
+        // One signal until the subscriber looks, however many commits land meanwhile
+        if (!__atomic_exchange_n(&conn->notified, 1, __ATOMIC_SEQ_CST)) {
+            eventfd_write(conn->notify_fd, 1);
+        }
+    }
+    pthread_mutex_unlock(&subscriber_mutex);
+}
+
+int conn_follow(client_conn_t *conn) {
+    eventfd_t value;
+
+    // Consumed, then cleared before the history is looked at: a commit landing after this signals again
+    eventfd_read(conn->notify_fd, &value);
+    __atomic_exchange_n(&conn->notified, 0, __ATOMIC_SEQ_CST);
+    return push_records(conn);
+}
+
+int conn_flush(client_conn_t *conn) {
+    out_chunk_t *chunk;
+
+    while ((chunk = STAILQ_FIRST(&conn->out_queue)) != NULL) {
+        size_t before = chunk->sent;
+        int ret = transmit_chunk(conn, chunk);
+
+        conn->out_pending -= chunk->sent - before;
+        if (ret != 0) {
+            return ret == 1 ? 0 : -1;
+        }
+
+        STAILQ_REMOVE_HEAD(&conn->out_queue, entries);
+        free_chunk(chunk);
+    }
+
+    cancel_evict_timer(conn);
+    // Records committed while a subscriber's queue drained go out now
+    return conn->notify_fd != -1 ? push_records(conn) : 0;
+}
+
+int conn_complete_send(client_conn_t *conn, size_t bytes) {
+    out_chunk_t *chunk = STAILQ_FIRST(&conn->out_queue);
+
+    chunk->sent += bytes;
+    conn->out_pending -= bytes;
+    METRIC_ADD(bytes_out, bytes);
+    METRIC_ADD(send_calls, 1);
+    touch(conn);
+
+    if (chunk->sent == chunk->len) {
+        STAILQ_REMOVE_HEAD(&conn->out_queue, entries);
+        free_chunk(chunk);
+    }
+    if (STAILQ_EMPTY(&conn->out_queue)) {
+        cancel_evict_timer(conn);
+        if (conn->notify_fd != -1) {
+            return push_records(conn);
+        }
+    }
+    return 0;
+}
+
+// Reply with the current counters and latency percentiles; nothing is stored
+static int handle_stats(client_conn_t *conn) {
+    char reply[STATS_REPLY_SIZE];
+    size_t len = metrics_format(reply, sizeof(reply));
+
+    return conn_send(conn, reply, len);
+}
+
+// Append records to FILE_PATH and, if they end a line, queue a replay of the history
+static int append_records(client_conn_t *conn, const char *data, size_t len) {
+    uint64_t start = metrics_now_ns();
+    int ret = history_append(conn->file_fd, data, len);
+
+    histogram_record(&metrics.append_latency, metrics_now_ns() - start);
+    if (ret == -1) {
+        return -1;
+    }
+    conn_publish();
+
+    if (data[len - 1] != '\n') {
+        return 0;
+    }
+
+    return replay_history(conn);
+}
+
+static int flush_records(client_conn_t *conn) {
+    if (conn->batch_len == 0) {
+        return 0;
+    }
+
+    int ret = append_records(conn, conn->batch, conn->batch_len);
+    conn->batch = NULL;
+    conn->batch_len = 0;
+    return ret;
+}
+
+static int handle_line(void *ctx, const char *line, size_t len) {
+    client_conn_t *conn = (client_conn_t*)ctx;
+    unsigned int write_cmd, write_cmd_offset;
+    unsigned long long resume_offset;
+
+    if (parse_seekto_command(line, len, &write_cmd, &write_cmd_offset)) {
+        // Records before the command are stored and replayed first to keep their order
+        if (flush_records(conn) == -1) {
+            return -1;
+        }
+        return handle_seekto(conn, write_cmd, write_cmd_offset);
+    }
+
+    if (parse_resume_command(line, len, &resume_offset)) {
+        if (flush_records(conn) == -1) {
+            return -1;
+        }
+        // From now on replays only carry what the client has not acknowledged yet
+        conn->resume = 1;
+        conn->cursor = resume_offset;
+        return replay_history(conn);
+    }
+
+    if (len == sizeof(SUBSCRIBE_COMMAND) && memcmp(line, SUBSCRIBE_COMMAND "\n", len) == 0) {
+        if (flush_records(conn) == -1) {
+            return -1;
+        }
+        return subscribe(conn);
+    }
+
+    if (len == sizeof(STATS_COMMAND) && memcmp(line, STATS_COMMAND "\n", len) == 0) {
+        if (flush_records(conn) == -1) {
+            return -1;
+        }
+        return handle_stats(conn);
+    }
+
+    METRIC_ADD(records_appended, 1);
+
+    // Back to back records from one read are appended together and replayed once
+    if (conn->batch_len > 0 && conn->batch + conn->batch_len == line) {
+        conn->batch_len += len;
+        return 0;
+    }
+
+    if (flush_records(conn) == -1) {
+        return -1;
+    }
+    conn->batch = line;
+    conn->batch_len = len;
+    return 0;
+}
+
+static int handle_text(client_conn_t *conn, const char *data, size_t len) {
+    if (framer_feed(&conn->framer, data, len, handle_line, conn) == -1) {
+        return -1;
+    }
+
+    return flush_records(conn);
+}
+
+/**
+ * Collect the first bytes of the connection until they either differ from
+ * BINARY_MAGIC, which makes it a text connection and replays the collected
+ * bytes as text, or complete it.
+ */
+static int negotiate(client_conn_t *conn, const char **data, size_t *len) {
+    size_t take = BINARY_MAGIC_LEN - conn->preamble_len;
+
+    if (take > *len) {
+        take = *len;
+    }
+    memcpy(conn->preamble + conn->preamble_len, *data, take);
+
+    if (memcmp(conn->preamble, BINARY_MAGIC, conn->preamble_len + take) != 0) {
+        conn->protocol = PROTOCOL_TEXT;
+        return conn->preamble_len > 0 ? handle_text(conn, conn->preamble, conn->preamble_len) : 0;
+    }
+
+    conn->preamble_len += take;
+    *data += take;
+    *len -= take;
+    if (conn->preamble_len < BINARY_MAGIC_LEN) {
+        return 0;
+    }
+
+    conn->protocol = PROTOCOL_BINARY;
+    return binary_start(conn);
+}
+
+int conn_handle_data(client_conn_t *conn, const char *data, size_t len) {
+    METRIC_ADD(bytes_in, len);
+    touch(conn);
+
+    if (conn->protocol == PROTOCOL_UNKNOWN) {
+        __atomic_store_n(&conn->spoke, 1, __ATOMIC_RELAXED);
+        if (negotiate(conn, &data, &len) == -1) {
+            return -1;
+        }
+    }
+
+    switch (conn->protocol) {
+        case PROTOCOL_TEXT:
+            return handle_text(conn, data, len);
+        case PROTOCOL_BINARY:
+            return len > 0 ? binary_feed(conn, data, len) : 0;
+        default:
+            return 0;
+    }
+}
+
+int conn_end_of_input(client_conn_t *conn) {
+    size_t len;
+    const char *line;
+
+    conn->read_closed = 1;
+    if (__atomic_load_n(&conn->evicted, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    if (conn->protocol == PROTOCOL_UNKNOWN) {
+        // A prefix of the preamble and nothing after it was text all along
+        conn->protocol = PROTOCOL_TEXT;
+        if (handle_text(conn, conn->preamble, conn->preamble_len) == -1) {
+            return -1;
+        }
+    }
+    if (conn->protocol == PROTOCOL_BINARY) {
+        // A truncated frame has no request to answer
+        return 0;
+    }
+
+    line = framer_pending(&conn->framer, &len);
+    if (len == 0) {
+        return 0;
+    }
+    if (handle_line(conn, line, len) == -1) {
+        return -1;
+    }
+    return flush_records(conn);
+}
+
+// Drain the socket until it would block; edge-triggered epoll only reports new data once
+int conn_receive(client_conn_t *conn) {
+    static __thread char buffer[RECV_BUFFER_SIZE];
+
+    while (1) {
+        ssize_t bytes_received = recv(conn->client_socket, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0) {
+            if (conn_handle_data(conn, buffer, bytes_received) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (bytes_received == 0) {
+            return conn_end_of_input(conn);
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        log_msg(LOG_ERR, "Failed to receive data: %s", strerror(errno));
+        return -1;
+    }
+}
+
+void conn_serve(client_conn_t *conn) {
+    struct pollfd pfd[2] = { { .fd = conn->client_socket }, { .fd = -1, .events = POLLIN } };
+
+    // Replies are flushed before honouring the peer's shutdown
+    while (!conn->read_closed || conn->out_pending > 0) {
+        pfd[0].events = (conn->read_closed ? 0 : POLLIN) | (conn->out_pending > 0 ? POLLOUT : 0);
+        // Only polled once the client subscribed
+        pfd[1].fd = conn->notify_fd;
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Failed to poll socket: %s", strerror(errno));
+            return;
+        }
+
+        if (pfd[0].revents & POLLNVAL) {
+            return;
+        }
+        if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) && !conn->read_closed) {
+            if (conn_receive(conn) == -1) {
+                return;
+            }
+        }
+        if ((pfd[1].revents & POLLIN) && conn_follow(conn) == -1) {
+            return;
+        }
+        if (conn_flush(conn) == -1) {
+            return;
+        }
+        if ((pfd[0].revents & (POLLHUP | POLLERR)) && conn->out_pending > 0) {
+            return;
+        }
+    }
+}
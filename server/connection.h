@@ -0,0 +1,226 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include "line_framer.h"
+#include "timer_wheel.h"
+#include "binary_proto.h"
+#include "segment_log.h"
+#include "history.h"
+
+/**
+ * One reply waiting in a connection's outbound queue: either len bytes at
+ * data, or, when data is NULL, len bytes of a segment file starting at
+ * offset, which are sent with sendfile(). The chunk holds a reference on the
+ * segment, or on the shared history view data points into, until it is freed.
+ */
+typedef struct out_chunk {
+    STAILQ_ENTRY(out_chunk) entries;
+    const char *data;
+    struct log_segment *segment;
+    struct history_view *view;
+    off_t offset;
+    size_t len;
+    size_t sent;
+} out_chunk_t;
+
+/**
+ * Which protocol a connection speaks, told apart by its first bytes.
+ */
+typedef enum {
+    PROTOCOL_UNKNOWN,               // Fewer bytes than BINARY_MAGIC seen so far, all matching it
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY
+} protocol_t;
+
+/**
+ * Per-client state shared by every I/O engine. Client sockets are always
+ * non-blocking; the protocol handling in connection.c only talks to the
+ * client through the outbound queue, so no send ever happens while
+ * file_mutex is held and a slow reader never stalls other clients.
+ */
+typedef struct client_conn {
+    int client_socket;
+    int file_fd;                    // Per-client handle on /dev/aesdchar, carries the seek position; -1 for the data file
+    struct sockaddr_in client_addr;
+    STAILQ_HEAD(out_queue, out_chunk) out_queue;
+    size_t out_pending;             // Unsent bytes across out_queue
+    int read_closed;                // Peer shut down its side, close once out_queue drains
+    int async_send;                 // The engine submits queued replies itself (io_uring)
+    int resume;                     // Replays start at cursor instead of the beginning
+    off_t cursor;                   // Absolute history offset the client has received up to
+    protocol_t protocol;
+    char preamble[BINARY_MAGIC_LEN];    // First bytes while protocol is PROTOCOL_UNKNOWN
+    size_t preamble_len;
+    struct binary_session *binary;  // Frame buffer and pending APPENDs in binary mode
+    line_framer_t framer;           // Incoming bytes of a record not terminated yet
+    const char *batch;              // Complete records received together, not stored yet
+    size_t batch_len;
+    wheel_timer_t idle_timer;       // Closes the connection after idle_timeout_ms without traffic
+    wheel_timer_t evict_timer;      // Evicts the client if replies stay queued for evict_timeout_ms
+    int evict_armed;                // evict_timer is armed, only touched by the serving thread
+    uint64_t last_active_ms;        // Last receive or send progress, see timer_now_ms()
+    int evicted;                    // Shut down by a timer or a handoff, unterminated input is discarded
+    int spoke;                      // Some data was received, see conn_drain_all()
+    int notify_fd;                  // eventfd signalled after commits, -1 unless subscribed
+    int notified;                   // notify_fd was signalled since conn_follow() last ran
+    int notify_watched;             // The engine waits on notify_fd, only touched by the serving thread
+    unsigned int pool_runs;         // Readiness reports the pool has not handled yet, see worker_pool.c
+    LIST_ENTRY(client_conn) entries;
+    LIST_ENTRY(client_conn) live;   // In the list of every open connection, see conn_drain_all()
+    LIST_ENTRY(client_conn) subscribers;    // In the list conn_publish() signals, while subscribed
+} client_conn_t;
+
+/**
+ * What happens to a reply that would push a connection past out_high_water.
+ */
+typedef enum {
+    OVERFLOW_DISCONNECT,
+    OVERFLOW_DROP
+} overflow_policy_t;
+
+// Maximum unsent bytes queued behind a slow reader, 0 for no limit
+extern size_t out_high_water;
+extern overflow_policy_t out_overflow_policy;
+
+/**
+ * Timer wheel deadlines, 0 to disable. A timer never closes a connection
+ * itself: it shuts the socket down and the engine serving the connection sees
+ * the hang-up and closes it as usual.
+ */
+extern unsigned long idle_timeout_ms;   // No data received or sent for this long
+extern unsigned long evict_timeout_ms;  // Queued replies not drained within this long
+
+/**
+ * Allocate the state for an accepted socket, make it non-blocking and, in
+ * the device build, open FILE_PATH for it.
+ * @return the new connection, or NULL on failure (the socket is closed in that case)
+ */
+client_conn_t *conn_create(int client_socket, const struct sockaddr_in *client_addr);
+
+/**
+ * Close the socket and file handle of @param conn and free it along with
+ * anything still queued.
+ */
+void conn_destroy(client_conn_t *conn);
+
+/**
+ * Run the aesdsocket protocol over @param len bytes received from the client.
+ * The bytes are split into newline terminated lines, which may span several
+ * calls; each line is either a command or a record to append, and every run
+ * of records is followed by a replay of the history. Commands are
+ * AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>,
+ * AESDSOCKET_RESUME:<offset>, which switches the connection to incremental
+ * replays that only carry history committed past <offset>,
+ * AESDSOCKET_SUBSCRIBE, after which records committed by any client are
+ * pushed to the connection as they are committed (it also switches to
+ * incremental replays, from the end of the history unless it resumed
+ * already), and AESDSOCKET_STATS, answered with the server metrics. A
+ * connection that opens with BINARY_MAGIC speaks the framed protocol of
+ * binary_proto.h instead.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_handle_data(client_conn_t *conn, const char *data, size_t len);
+
+/**
+ * The peer shut down its side: mark @param conn read_closed and handle the
+ * unterminated line it may have left as a final one.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_end_of_input(client_conn_t *conn);
+
+/**
+ * Receive and handle data until the socket would block or the peer shuts
+ * down its side (read_closed is set then).
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_receive(client_conn_t *conn);
+
+/**
+ * Serve @param conn from the calling thread, waiting in poll() for it to
+ * become readable or writable, until the peer closes the connection and
+ * every reply has been sent, or an error occurs.
+ */
+void conn_serve(client_conn_t *conn);
+
+/**
+ * Queue @param len bytes for the client and send as much as the socket takes
+ * right away, unless async_send leaves sending to the engine.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_send(client_conn_t *conn, const char *data, size_t len);
+
+/**
+ * Queue @param len bytes of the history starting at offset @param offset,
+ * one chunk per segment the range spans, and send as much as the socket
+ * takes right away.
+ * @return 0 on success, -1 if the connection should be closed, including
+ *      when retention removed part of the range
+ */
+int conn_send_file(client_conn_t *conn, off_t offset, size_t len);
+
+/**
+ * Queue @param len bytes of @param view starting @param start bytes into its
+ * data, and send as much as the socket takes right away. Queued bytes are not
+ * copied, the reference on @param view passes to the queue.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_send_view(client_conn_t *conn, history_view_t *view, size_t start, size_t len);
+
+/**
+ * Push queued outbound bytes to the socket until it would block.
+ * @return 0 on success, -1 on a socket error
+ */
+int conn_flush(client_conn_t *conn);
+
+/**
+ * Account for @param bytes of the head of out_queue that the engine sent
+ * itself, freeing the chunk once it is complete. Used with async_send.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_complete_send(client_conn_t *conn, size_t bytes);
+
+/**
+ * Signal every subscriber that records were committed. Cheap to call after
+ * every append: only the first call per history generation walks the
+ * subscribers, and a subscriber is signalled once until it catches up.
+ */
+void conn_publish(void);
+
+/**
+ * Called by the engine serving @param conn when its notify_fd is readable:
+ * consume the signal and push what was committed past the cursor as one
+ * incremental replay. Nothing is queued behind replies still waiting for the
+ * socket; the push follows with whatever else was committed once they drained.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+int conn_follow(client_conn_t *conn);
+
+/**
+ * Stop reading from every open connection that has sent data: each one sees
+ * end of input after the data already received, discards an unterminated
+ * request, sends the replies it has queued and is closed by its engine as
+ * usual. Connections that have not sent anything yet, including any accepted
+ * later, may have their first request on the way and are served normally.
+ */
+void conn_drain_all(void);
+
+/**
+ * Shut down every open connection in both directions, dropping queued replies.
+ */
+void conn_abort_all(void);
+
+/**
+ * Wait until every connection has been destroyed.
+ */
+void conn_wait_all_closed(void);
+
+/**
+ * Log how many bytes were sent to clients and how many syscalls that took.
+ */
+void conn_log_send_stats(void);
+
+#endif /* CONNECTION_H */
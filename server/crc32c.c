@@ -0,0 +1,77 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78          // Castagnoli polynomial, bit reversed
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const unsigned char *data, size_t len);
+
+static uint32_t table[8][256];
+static crc32c_fn_t crc32c_impl;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Process eight bytes per step with one lookup into each of the eight tables
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    return ~crc32c_impl(~crc, data, len);
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extend @param crc, 0 for a fresh checksum, with the CRC-32C (Castagnoli) of
+ * @param len bytes at @param data. Uses the SSE4.2 crc32 instruction when the
+ * CPU has it and a slice-by-8 table otherwise; both give the same result.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "epoll_engine.h"
+#include "logger.h"
+
+#define MAX_EVENTS 64
+#define NOTIFY_TAG 1                // Low bit of the epoll data of a subscriber's notify_fd
+
+typedef struct event_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;                    // eventfd used to interrupt epoll_wait() on shutdown
+    pthread_mutex_t conn_mutex;     // Protects conn_list, which the accept thread also inserts into
+    LIST_HEAD(conn_list, client_conn) conn_list;
+} event_loop_t;
+
+static event_loop_t *loops = NULL;
+static int loop_count = 0;
+static unsigned int next_loop = 0;
+
+static void close_connection(event_loop_t *loop, client_conn_t *conn) {
+    pthread_mutex_lock(&loop->conn_mutex);
+    LIST_REMOVE(conn, entries);
+    pthread_mutex_unlock(&loop->conn_mutex);
+
+    // Closing the socket also drops it from the epoll set
+    conn_destroy(conn);
+}
+
+// Start waiting on the notify_fd of a connection that just subscribed
+static int watch_notify(event_loop_t *loop, client_conn_t *conn) {
+    if (conn->notify_fd == -1 || conn->notify_watched) {
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = (void *)((uintptr_t)conn | NOTIFY_TAG) };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->notify_fd, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to add subscriber eventfd to epoll: %s", strerror(errno));
+        return -1;
+    }
+    conn->notify_watched = 1;
+    return 0;
+}
+
+// Handle socket @param events, or the notify_fd firing if @param notify; returns 1 if the connection was closed
+static int handle_event(event_loop_t *loop, client_conn_t *conn, uint32_t events, int notify) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(loop, conn);
+        return 1;
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !conn->read_closed) {
+        if (conn_receive(conn) == -1) {
+            close_connection(loop, conn);
+            return 1;
+        }
+    }
+
+    if ((notify && conn_follow(conn) == -1) || watch_notify(loop, conn) == -1 || conn_flush(conn) == -1) {
+        close_connection(loop, conn);
+        return 1;
+    }
+
+    // Replies are flushed before honouring the peer's shutdown, like the blocking path does
+    if (conn->read_closed && conn->out_pending == 0) {
+        close_connection(loop, conn);
+        return 1;
+    }
+    return 0;
+}
+
+// A subscriber has two descriptors, drop the events left in the batch for one that was closed
+static void forget_events(struct epoll_event *events, int from, int count, client_conn_t *conn) {
+    for (int i = from; i < count; i++) {
+        if (((uintptr_t)events[i].data.ptr & ~(uintptr_t)NOTIFY_TAG) == (uintptr_t)conn) {
+            events[i].events = 0;
+        }
+    }
+}
+
+static void* event_loop_run(void* arg) {
+    event_loop_t *loop = (event_loop_t*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!exit_flag) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+
+            if (events[i].events == 0) {
+                continue;
+            }
+            if (data == 0) {
+                uint64_t value;
+                if (read(loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    log_msg(LOG_ERR, "Failed to read wake eventfd: %s", strerror(errno));
+                }
+                continue;
+            }
+
+            client_conn_t *conn = (client_conn_t *)(data & ~(uintptr_t)NOTIFY_TAG);
+            int notify = data & NOTIFY_TAG;
+            if (handle_event(loop, conn, notify ? 0 : events[i].events, notify)) {
+                forget_events(events, i + 1, n, conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int epoll_engine_start(int num_loops) {
+    loops = calloc(num_loops, sizeof(event_loop_t));
+    if (loops == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate memory for event loops: %s", strerror(errno));
+        return -1;
+    }
+
+    for (loop_count = 0; loop_count < num_loops; loop_count++) {
+        event_loop_t *loop = &loops[loop_count];
+
+        LIST_INIT(&loop->conn_list);
+        pthread_mutex_init(&loop->conn_mutex, NULL);
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd == -1) {
+            log_msg(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+            break;
+        }
+
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wake_fd == -1) {
+            log_msg(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+            close(loop->epoll_fd);
+            break;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1 ||
+            pthread_create(&loop->thread, NULL, event_loop_run, loop) != 0) {
+            log_msg(LOG_ERR, "Failed to start event loop: %s", strerror(errno));
+            close(loop->wake_fd);
+            close(loop->epoll_fd);
+            break;
+        }
+    }
+
+    if (loop_count != num_loops) {
+        epoll_engine_stop();
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Started %d epoll event loops", loop_count);
+    return 0;
+}
+
+int epoll_engine_add(client_conn_t *conn) {
+    event_loop_t *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % loop_count];
+
+    pthread_mutex_lock(&loop->conn_mutex);
+    LIST_INSERT_HEAD(&loop->conn_list, conn, entries);
+    pthread_mutex_unlock(&loop->conn_mutex);
+
+    // The loop may start handling the connection before epoll_ctl() returns
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->client_socket, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to add socket to epoll: %s", strerror(errno));
+        close_connection(loop, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+void epoll_engine_stop(void) {
+    uint64_t one = 1;
+
+    for (int i = 0; i < loop_count; i++) {
+        if (write(loops[i].wake_fd, &one, sizeof(one)) == -1) {
+            log_msg(LOG_ERR, "Failed to wake event loop: %s", strerror(errno));
+        }
+    }
+
+    for (int i = 0; i < loop_count; i++) {
+        event_loop_t *loop = &loops[i];
+
+        pthread_join(loop->thread, NULL);
+
+        while (!LIST_EMPTY(&loop->conn_list)) {
+            client_conn_t *conn = LIST_FIRST(&loop->conn_list);
+            LIST_REMOVE(conn, entries);
+            conn_destroy(conn);
+        }
+
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        pthread_mutex_destroy(&loop->conn_mutex);
+    }
+
+    free(loops);
+    loops = NULL;
+    loop_count = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+#include "connection.h"
+
+/**
+ * Start @param num_loops event-loop threads, each owning an edge-triggered
+ * epoll instance that multiplexes its share of the client sockets.
+ * @return 0 on success, -1 on failure
+ */
+int epoll_engine_start(int num_loops);
+
+/**
+ * Hand @param conn to one of the event loops (round robin). The engine owns
+ * the connection afterwards.
+ * @return 0 on success, -1 on failure (the connection is destroyed in that case)
+ */
+int epoll_engine_add(client_conn_t *conn);
+
+/**
+ * Wake every event loop, wait for them to exit and close the connections
+ * they still own.
+ */
+void epoll_engine_stop(void);
+
+#endif /* EPOLL_ENGINE_H */
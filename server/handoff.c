@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include "server.h"
+#include "handoff.h"
+#include "connection.h"
+#include "timer_wheel.h"
+#include "logger.h"
+
+#define HANDOFF_FD 3                // Where the successor finds its end of the handoff socket
+#define LISTEN_FDS_START 3          // First socket passed by socket activation
+#define HANDOFF_READY 'R'           // Successor to predecessor: started, waiting for the sockets
+#define HANDOFF_SOCKETS 'S'         // Predecessor to successor: the listening sockets
+
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+} socket_control_t;
+
+static char *exec_path = NULL;
+static char **exec_argv = NULL;
+static sem_t request_sem;
+static pthread_t handoff_thread;
+static int thread_started = 0;
+static int stopping = 0;
+static pid_t successor = -1;
+static int successor_fd = -1;
+static wheel_timer_t drain_timer;
+
+// Sockets we did not open ourselves are only used if they are listening already
+static int check_listener(int fd) {
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+        log_msg(LOG_ERR, "Inherited descriptor %d is not a listening socket", fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_sockets(const int *sockets, int count) {
+    for (int i = 0; i < count; i++) {
+        close(sockets[i]);
+    }
+}
+
+int handoff_init(char *argv[]) {
+    // A bare name is looked up in PATH again, anything else is resolved now
+    exec_path = strchr(argv[0], '/') != NULL ? realpath(argv[0], NULL) : strdup(argv[0]);
+    if (exec_path == NULL) {
+        log_msg(LOG_ERR, "Failed to resolve %s: %s", argv[0], strerror(errno));
+        return -1;
+    }
+    exec_argv = argv;
+
+    if (sem_init(&request_sem, 0, 0) == -1) {
+        log_msg(LOG_ERR, "Failed to create handoff semaphore: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Tell the predecessor on @param fd we are up and wait for its sockets
+static int receive_sockets(int fd, int *sockets, int max) {
+    socket_control_t control;
+    char message = HANDOFF_READY;
+    struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t received;
+
+    if (write(fd, &message, sizeof(message)) != sizeof(message)) {
+        log_msg(LOG_WARNING, "Predecessor is gone, opening new listening sockets");
+        return 0;
+    }
+
+    do {
+        received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    if (received == -1) {
+        log_msg(LOG_ERR, "Failed to receive listening sockets: %s", strerror(errno));
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received == 0 || message != HANDOFF_SOCKETS || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        // It exited without handing over, so its sockets are closed and the port is free
+        log_msg(LOG_WARNING, "Predecessor did not pass its listening sockets, opening new ones");
+        return 0;
+    }
+
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(sockets, CMSG_DATA(cmsg), sizeof(int) * count);
+    if (count > max) {
+        close_sockets(sockets + max, count - max);
+        count = max;
+    }
+    return count;
+}
+
+int handoff_receive(int *sockets, int max) {
+    const char *handoff = getenv(HANDOFF_ENV);
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    int count = 0;
+
+    if (max > HANDOFF_MAX_SOCKETS) {
+        max = HANDOFF_MAX_SOCKETS;
+    }
+
+    if (handoff != NULL) {
+        int fd = strtol(handoff, NULL, 10);
+        count = receive_sockets(fd, sockets, max);
+        close(fd);
+        if (count > 0) {
+            log_msg(LOG_INFO, "Took over %d listening socket(s) from the previous process", count);
+        }
+    } else if (listen_pid != NULL && listen_fds != NULL && strtol(listen_pid, NULL, 10) == getpid()) {
+        count = strtol(listen_fds, NULL, 10);
+        if (count < 1 || count > max) {
+            log_msg(LOG_ERR, "Cannot use %s inherited listening sockets, at most %d are supported", listen_fds, max);
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            sockets[i] = LISTEN_FDS_START + i;
+            fcntl(sockets[i], F_SETFD, FD_CLOEXEC);
+        }
+        log_msg(LOG_INFO, "Inherited %d listening socket(s)", count);
+    }
+
+    // Nothing of this applies to a successor we start later
+    unsetenv(HANDOFF_ENV);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (int i = 0; i < count; i++) {
+        if (check_listener(sockets[i]) == -1) {
+            close_sockets(sockets, count);
+            return -1;
+        }
+    }
+    return count;
+}
+
+static void abandon_successor(void) {
+    kill(successor, SIGKILL);
+    waitpid(successor, NULL, 0);
+    close(successor_fd);
+    successor = -1;
+    successor_fd = -1;
+}
+
+// Execute the binary again and wait for it to report that it started
+static int spawn_successor(void) {
+    extern char **environ;
+    char handoff_var[64];
+    char message;
+    int pair[2];
+    size_t env_count = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        log_msg(LOG_ERR, "Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // The child of a threaded process must not allocate, so its environment is built here
+    while (environ[env_count] != NULL) {
+        env_count++;
+    }
+    char **envp = calloc(env_count + 2, sizeof(char*));
+    if (envp == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate memory for environment: %s", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    memcpy(envp, environ, env_count * sizeof(char*));
+    snprintf(handoff_var, sizeof(handoff_var), "%s=%d", HANDOFF_ENV, HANDOFF_FD);
+    envp[env_count] = handoff_var;
+
+    successor = fork();
+    if (successor == 0) {
+        // Only stdio and the handoff socket survive, clients must not be held open by the successor
+        if (pair[1] == HANDOFF_FD) {
+            fcntl(HANDOFF_FD, F_SETFD, 0);
+        } else {
+            dup2(pair[1], HANDOFF_FD);
+        }
+        close_range(HANDOFF_FD + 1, ~0U, 0);
+        execvpe(exec_path, exec_argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(pair[1]);
+    successor_fd = pair[0];
+    if (successor == -1) {
+        log_msg(LOG_ERR, "Failed to fork successor: %s", strerror(errno));
+        close(successor_fd);
+        successor_fd = -1;
+        return -1;
+    }
+
+    struct pollfd pfd = { .fd = successor_fd, .events = POLLIN };
+    if (poll(&pfd, 1, HANDOFF_READY_TIMEOUT_MS) != 1 ||
+        read(successor_fd, &message, sizeof(message)) != sizeof(message) || message != HANDOFF_READY) {
+        log_msg(LOG_ERR, "Successor %s did not start, keeping the listening sockets", exec_path);
+        abandon_successor();
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Successor started as pid %d, draining connections", successor);
+    return 0;
+}
+
+static void drain_expired(void *arg) {
+    (void)arg;
+
+    log_msg(LOG_WARNING, "Connections not drained within %d ms, closing them", HANDOFF_DRAIN_MS);
+    conn_abort_all();
+}
+
+static void* handoff_run(void* arg) {
+    (void)arg;
+
+    while (1) {
+        if (sem_wait(&request_sem) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Failed to wait for handoff request: %s", strerror(errno));
+            break;
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (spawn_successor() == -1) {
+            continue;
+        }
+        if (exit_flag) {
+            // Shutting down anyway, and the listening sockets may be shut down already
+            abandon_successor();
+            break;
+        }
+
+        handoff_flag = 1;
+        // Wakes the accept loops and the io_uring engine; the listening sockets stay open
+        eventfd_write(shutdown_event_fd, 1);
+        conn_drain_all();
+        timer_arm(&drain_timer, HANDOFF_DRAIN_MS);
+        break;
+    }
+    return NULL;
+}
+
+int handoff_start(void) {
+    timer_init(&drain_timer, drain_expired, NULL);
+    if (pthread_create(&handoff_thread, NULL, handoff_run, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create handoff thread");
+        return -1;
+    }
+    thread_started = 1;
+    return 0;
+}
+
+void handoff_request(void) {
+    sem_post(&request_sem);
+}
+
+void handoff_stop(void) {
+    if (thread_started) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        sem_post(&request_sem);
+        pthread_join(handoff_thread, NULL);
+        thread_started = 0;
+    }
+}
+
+int handoff_send(const int *sockets, int count) {
+    socket_control_t control;
+    char message = HANDOFF_SOCKETS;
+    struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count)
+    };
+    ssize_t sent;
+
+    memset(&control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), sockets, sizeof(int) * count);
+
+    do {
+        sent = sendmsg(successor_fd, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    close(successor_fd);
+    successor_fd = -1;
+    if (sent == -1) {
+        log_msg(LOG_ERR, "Failed to pass listening sockets to pid %d: %s", successor, strerror(errno));
+        return -1;
+    }
+    log_msg(LOG_INFO, "Passed %d listening socket(s) to pid %d", count, successor);
+    return 0;
+}
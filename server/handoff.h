@@ -0,0 +1,62 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/**
+ * Zero-downtime restarts. On SIGUSR2 the running daemon executes its binary
+ * again, by the path it was started with, so an upgraded binary takes over.
+ * The successor finds one end of a Unix socket at the descriptor named by
+ * HANDOFF_ENV and reports that it started. The daemon then stops accepting
+ * without closing its listening sockets, drains its connections for at most
+ * HANDOFF_DRAIN_MS, closes the history and passes the sockets over with
+ * SCM_RIGHTS before it exits. Connections arriving meanwhile wait in the
+ * listen backlog instead of being refused.
+ *
+ * Listening sockets can also be inherited at startup the way socket
+ * activation passes them: LISTEN_FDS sockets from descriptor 3 on, for the
+ * process whose pid is LISTEN_PID.
+ */
+#define HANDOFF_ENV "AESDSOCKET_HANDOFF_FD"
+#define HANDOFF_MAX_SOCKETS 64
+#define HANDOFF_READY_TIMEOUT_MS 5000   // How long the successor has to start
+#define HANDOFF_DRAIN_MS 5000           // Connections still open after this are shut down
+
+/**
+ * Remember how this process was started, for a later handoff. Call before
+ * run_as_daemon() changes directory.
+ * @return 0 on success, -1 on failure
+ */
+int handoff_init(char *argv[]);
+
+/**
+ * Take over the listening sockets of a predecessor, blocking until it has
+ * drained and closed the history, or the ones passed by socket activation.
+ * @param sockets receives at most @param max listening sockets
+ * @return how many sockets were inherited, 0 to open new ones, -1 on failure
+ */
+int handoff_receive(int *sockets, int max);
+
+/**
+ * Start the thread that performs a handoff when handoff_request() is called.
+ * @return 0 on success, -1 on failure
+ */
+int handoff_start(void);
+
+/**
+ * Ask for a handoff. Async-signal-safe.
+ */
+void handoff_request(void);
+
+/**
+ * Stop the handoff thread. If it started a handoff, handoff_flag is set once
+ * this returns and the caller must wait for the connections to drain.
+ */
+void handoff_stop(void);
+
+/**
+ * Pass @param count listening @param sockets to the successor once the
+ * connections are drained and the history is closed.
+ * @return 0 on success, -1 on failure
+ */
+int handoff_send(const int *sockets, int count);
+
+#endif /* HANDOFF_H */
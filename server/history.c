@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include "server.h"
+#include "history.h"
+#include "metrics.h"
+#include "logger.h"
+#include "segment_log.h"
+#include "timer_wheel.h"
+
+#define HISTORY_COPY_RETRIES 4
+
+/**
+ * An appender parked in the commit queue. The first appender to find no
+ * commit in progress becomes the leader: it writes every queued record with a
+ * single writev(), publishes them and wakes the rest.
+ */
+typedef struct append_request {
+    const char *data;
+    size_t len;
+    off_t end;                  // History offset just past the record once committed
+    int ret;
+    int done;
+    STAILQ_ENTRY(append_request) entries;
+} append_request_t;
+
+sync_policy_t history_sync_policy = SYNC_NONE;
+unsigned long history_sync_interval_ms = 0;
+
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(commit_queue, append_request) commit_queue = STAILQ_HEAD_INITIALIZER(commit_queue);
+static int commit_in_progress = 0;
+static struct timespec last_sync;
+#ifndef USE_AESD_CHAR_DEVICE
+// Under SYNC_INTERVAL, commits not synced yet wait for sync_timer at most; both under file_mutex
+static wheel_timer_t sync_timer;
+static int sync_pending = 0;
+#endif
+
+static unsigned long seq = 0;
+static off_t committed_len = 0;
+static unsigned long generation = 0;
+
+// Contention counters, reported at shutdown
+static unsigned long lockfree_reads = 0;
+static unsigned long read_retries = 0;
+static unsigned long locked_reads = 0;
+static unsigned long writer_contended = 0;
+static unsigned long committed_records = 0;
+static unsigned long commit_batches = 0;
+static unsigned long data_syncs = 0;
+
+#ifdef USE_AESD_CHAR_DEVICE
+// The newest view of the ring, replaced by the first replay after an append
+static pthread_mutex_t view_mutex = PTHREAD_MUTEX_INITIALIZER;
+static history_view_t *current_view = NULL;
+static unsigned long view_builds = 0;
+static unsigned long view_shares = 0;
+#endif
+
+// Take file_mutex, accounting for the time a contended lock kept the caller waiting; returns 1 if it was contended
+static int lock_file_mutex(void) {
+    if (pthread_mutex_trylock(&file_mutex) == 0) {
+        return 0;
+    }
+
+    uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(&file_mutex);
+    METRIC_ADD(file_mutex_wait_ns, metrics_now_ns() - start);
+    return 1;
+}
+
+static void write_begin(void) {
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(void) {
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// Records committed before a failed sync were acknowledged under SYNC_INTERVAL, try again later; file_mutex held
+static void retry_sync(void) {
+    if (history_sync_policy == SYNC_INTERVAL && !sync_pending) {
+        sync_pending = 1;
+        timer_arm(&sync_timer, history_sync_interval_ms);
+    }
+}
+
+// Runs on the timer thread an interval after the last sync, unless an append synced since
+static void sync_expired(void *arg) {
+    (void)arg;
+
+    lock_file_mutex();
+    if (sync_pending) {
+        sync_pending = 0;
+        clock_gettime(CLOCK_MONOTONIC, &last_sync);
+        if (segment_sync() == -1) {
+            retry_sync();
+        }
+        __atomic_add_fetch(&data_syncs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+int history_find_record(unsigned int write_cmd, unsigned int write_cmd_offset, off_t *offset) {
+    return segment_find_record(write_cmd, write_cmd_offset, offset);
+}
+#endif
+
+int history_init(void) {
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // A device has no size, count what the ring holds already
+    int fd = open(FILE_PATH, O_RDONLY);
+    if (fd != -1) {
+        off_t start = 0;
+        size_t len;
+        char *content = read_to_end(fd, &start, &len);
+        if (content != NULL) {
+            committed_len = len;
+            free(content);
+        }
+        close(fd);
+    }
+    return 0;
+#else
+    timer_init(&sync_timer, sync_expired, NULL);
+
+    // The history survives restarts, offsets carry on from the end of the log
+    return segment_log_open(&committed_len);
+#endif
+}
+
+void history_close(void) {
+#ifdef USE_AESD_CHAR_DEVICE
+    if (current_view != NULL) {
+        history_view_release(current_view);
+        current_view = NULL;
+    }
+#else
+    segment_log_close();
+#endif
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+// Write @param iov out completely, advancing past partial writes; returns the bytes written
+static size_t write_all(int fd, struct iovec *iov, int iovcnt, int *ret) {
+    size_t written_total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Failed to write file: %s", strerror(errno));
+            *ret = -1;
+            break;
+        }
+        written_total += written;
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return written_total;
+}
+#else
+static int sync_due(void) {
+    struct timespec now;
+
+    if (history_sync_policy == SYNC_BATCH) {
+        return 1;
+    }
+    if (history_sync_policy != SYNC_INTERVAL) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long elapsed_ms = (now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+    if (elapsed_ms < history_sync_interval_ms) {
+        // The commit must not stay unsynced until the next append, which may never come
+        if (!sync_pending) {
+            sync_pending = 1;
+            timer_arm(&sync_timer, history_sync_interval_ms - elapsed_ms);
+        }
+        return 0;
+    }
+    last_sync = now;
+    sync_pending = 0;
+    return 1;
+}
+#endif
+
+// Write and publish one batch; the caller is the leader and holds no lock
+static int commit_batch(int fd, append_request_t **batch, int count) {
+    struct iovec iov[HISTORY_BATCH_MAX];
+    size_t written_total;
+    int ret = 0;
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)batch[i]->data;
+        iov[i].iov_len = batch[i]->len;
+    }
+
+    if (lock_file_mutex()) {
+        __atomic_add_fetch(&writer_contended, 1, __ATOMIC_RELAXED);
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // The device contents change as soon as the write starts
+    write_begin();
+#endif
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // The device has no write_iter, so writev() still stores each record as its own write
+    written_total = write_all(fd, iov, count, &ret);
+#else
+    // The segment takes the whole batch or none of it
+    (void)fd;
+    ret = segment_append(iov, count);
+    written_total = 0;
+    for (int i = 0; ret == 0 && i < count; i++) {
+        written_total += batch[i]->len;
+    }
+#endif
+
+#ifndef USE_AESD_CHAR_DEVICE
+    // Records are only published once they are as durable as the policy asks; a batch
+    // that could not be synced is taken back out of the log and reported as failed
+    if (ret == 0 && sync_due()) {
+        if (segment_sync() == -1) {
+            segment_undo_append();
+            retry_sync();
+            written_total = 0;
+            ret = -1;
+        }
+        __atomic_add_fetch(&data_syncs, 1, __ATOMIC_RELAXED);
+    }
+#endif
+
+    // committed_len only moves under file_mutex, so the batch lands right after it
+    off_t end = committed_len;
+    for (int i = 0; ret == 0 && i < count; i++) {
+        end += batch[i]->len;
+        batch[i]->end = end;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    // File readers only look at committed_len, so the window is just the publish
+    write_begin();
+#endif
+    // A failed batch stored nothing in the log; on the device it may have stored some records
+    __atomic_store_n(&committed_len, committed_len + written_total, __ATOMIC_RELAXED);
+    if (written_total > 0) {
+        __atomic_store_n(&generation, generation + 1, __ATOMIC_RELAXED);
+    }
+    write_end();
+
+    pthread_mutex_unlock(&file_mutex);
+
+    if (ret == 0) {
+        __atomic_add_fetch(&committed_records, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&commit_batches, 1, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+int history_append(int fd, const char *data, size_t len) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+
+    return history_appendv(fd, &iov, 1, NULL);
+}
+
+int history_appendv(int fd, const struct iovec *iov, int count, off_t *end_offsets) {
+    append_request_t requests[HISTORY_BATCH_MAX];
+    append_request_t *batch[HISTORY_BATCH_MAX];
+    append_request_t *last = &requests[count - 1];
+
+    pthread_mutex_lock(&commit_mutex);
+    // Queued back to back and committed in order, so once the last is done all are
+    for (int i = 0; i < count; i++) {
+        requests[i] = (append_request_t){ .data = iov[i].iov_base, .len = iov[i].iov_len };
+        STAILQ_INSERT_TAIL(&commit_queue, &requests[i], entries);
+    }
+
+    while (!last->done) {
+        if (commit_in_progress) {
+            // A leader is writing, these records go out with a later batch
+            pthread_cond_wait(&commit_done, &commit_mutex);
+            continue;
+        }
+
+        int batch_count = 0;
+        while (batch_count < HISTORY_BATCH_MAX && !STAILQ_EMPTY(&commit_queue)) {
+            batch[batch_count++] = STAILQ_FIRST(&commit_queue);
+            STAILQ_REMOVE_HEAD(&commit_queue, entries);
+        }
+        commit_in_progress = 1;
+        pthread_mutex_unlock(&commit_mutex);
+
+        int ret = commit_batch(fd, batch, batch_count);
+
+        pthread_mutex_lock(&commit_mutex);
+        for (int i = 0; i < batch_count; i++) {
+            batch[i]->ret = ret;
+            batch[i]->done = 1;
+        }
+        commit_in_progress = 0;
+        pthread_cond_broadcast(&commit_done);
+    }
+
+    pthread_mutex_unlock(&commit_mutex);
+
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        if (requests[i].ret == -1) {
+            ret = -1;
+        }
+        if (end_offsets != NULL) {
+            end_offsets[i] = requests[i].end;
+        }
+    }
+    return ret;
+}
+
+void history_sync(void) {
+#ifndef USE_AESD_CHAR_DEVICE
+    if (history_sync_policy == SYNC_NONE) {
+        return;
+    }
+
+    lock_file_mutex();
+    segment_sync();
+    pthread_mutex_unlock(&file_mutex);
+#endif
+}
+
+void history_snapshot(history_snapshot_t *snapshot) {
+    unsigned long start;
+
+    do {
+        while ((start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        snapshot->length = __atomic_load_n(&committed_len, __ATOMIC_RELAXED);
+        snapshot->generation = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&seq, __ATOMIC_RELAXED) != start);
+
+    __atomic_add_fetch(&lockfree_reads, 1, __ATOMIC_RELAXED);
+}
+
+char *read_to_end(int fd, off_t *offset, size_t *len) {
+    size_t cap = BUFFER_SIZE;
+    char *buffer = malloc(cap);
+    ssize_t bytes_read;
+
+    *len = 0;
+    while (buffer != NULL) {
+        if (*len == cap) {
+            char *new_buffer = realloc(buffer, cap * 2);
+            if (new_buffer == NULL) {
+                break;
+            }
+            buffer = new_buffer;
+            cap *= 2;
+        }
+
+        if (offset != NULL) {
+            bytes_read = pread(fd, buffer + *len, cap - *len, *offset + *len);
+        } else {
+            bytes_read = read(fd, buffer + *len, cap - *len);
+        }
+        if (bytes_read == 0) {
+            return buffer;
+        }
+        if (bytes_read == -1 && errno != EINTR) {
+            break;
+        }
+        if (bytes_read > 0) {
+            *len += bytes_read;
+        }
+    }
+
+    log_msg(LOG_ERR, "Failed to read file: %s", strerror(errno));
+    free(buffer);
+    return NULL;
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+/**
+ * Copy the whole ring out of @param fd, retrying when an append overlaps the
+ * copy and only falling back to file_mutex after several attempts.
+ * @param snapshot receives the committed length matching the copy
+ */
+static char *history_copy(int fd, size_t *len, history_snapshot_t *snapshot) {
+    off_t start_offset = 0;
+    char *buffer;
+
+    for (int attempt = 0; attempt < HISTORY_COPY_RETRIES; attempt++) {
+        unsigned long start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        if (start & 1) {
+            __atomic_add_fetch(&read_retries, 1, __ATOMIC_RELAXED);
+            sched_yield();
+            continue;
+        }
+
+        buffer = read_to_end(fd, &start_offset, len);
+        if (buffer == NULL) {
+            return NULL;
+        }
+
+        snapshot->length = __atomic_load_n(&committed_len, __ATOMIC_RELAXED);
+        snapshot->generation = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == start) {
+            __atomic_add_fetch(&lockfree_reads, 1, __ATOMIC_RELAXED);
+            return buffer;
+        }
+
+        // An append overlapped the copy, it may mix old and new ring contents
+        free(buffer);
+        __atomic_add_fetch(&read_retries, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&locked_reads, 1, __ATOMIC_RELAXED);
+    lock_file_mutex();
+    buffer = read_to_end(fd, &start_offset, len);
+    snapshot->length = committed_len;
+    snapshot->generation = generation;
+    pthread_mutex_unlock(&file_mutex);
+    return buffer;
+}
+
+history_view_t *history_view_acquire(int fd) {
+    history_snapshot_t snapshot;
+    history_view_t *view;
+
+    history_snapshot(&snapshot);
+
+    // Replays arriving while the view is rebuilt wait here and share the new copy
+    pthread_mutex_lock(&view_mutex);
+    if (current_view == NULL || current_view->snapshot.generation < snapshot.generation) {
+        view = malloc(sizeof(history_view_t));
+        if (view == NULL) {
+            log_msg(LOG_ERR, "Failed to allocate memory for history view: %s", strerror(errno));
+            pthread_mutex_unlock(&view_mutex);
+            return NULL;
+        }
+        view->data = history_copy(fd, &view->len, &view->snapshot);
+        if (view->data == NULL) {
+            free(view);
+            pthread_mutex_unlock(&view_mutex);
+            return NULL;
+        }
+        view->refs = 1;
+
+        if (current_view != NULL) {
+            history_view_release(current_view);
+        }
+        current_view = view;
+        view_builds++;
+    } else {
+        view_shares++;
+    }
+
+    view = current_view;
+    __atomic_add_fetch(&view->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&view_mutex);
+    return view;
+}
+#endif
+
+void history_view_release(history_view_t *view) {
+    if (__atomic_sub_fetch(&view->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(view->data);
+        free(view);
+    }
+}
+
+void history_log_stats(void) {
+    unsigned long records = __atomic_load_n(&committed_records, __ATOMIC_RELAXED);
+    unsigned long batches = __atomic_load_n(&commit_batches, __ATOMIC_RELAXED);
+
+    log_msg(LOG_INFO, "Group commit: %lu appends in %lu writes (%lu.%02lu per write), %lu data syncs",
+           records, batches, batches ? records / batches : 0, batches ? records * 100 / batches % 100 : 0,
+           __atomic_load_n(&data_syncs, __ATOMIC_RELAXED));
+    log_msg(LOG_INFO, "History: %lu lock-free reads, %lu read retries, %lu locked reads, %lu contended appends",
+           __atomic_load_n(&lockfree_reads, __ATOMIC_RELAXED),
+           __atomic_load_n(&read_retries, __ATOMIC_RELAXED),
+           __atomic_load_n(&locked_reads, __ATOMIC_RELAXED),
+           __atomic_load_n(&writer_contended, __ATOMIC_RELAXED));
+#ifdef USE_AESD_CHAR_DEVICE
+    log_msg(LOG_INFO, "Replay views: %lu device copies shared by %lu more replays", view_builds, view_shares);
+#endif
+}
@@ -0,0 +1,133 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define HISTORY_BATCH_MAX 64            // Records per writev(), well under IOV_MAX
+
+/**
+ * Appends to FILE_PATH are serialized by file_mutex and published through a
+ * seqlock: seq is odd while an update is in flight, committed_len and
+ * generation change only inside that window. Replays read a consistent
+ * snapshot without ever taking file_mutex, so they no longer serialize
+ * against appends.
+ */
+typedef struct history_snapshot {
+    off_t length;               // History bytes safe to replay
+    unsigned long generation;   // Number of appends committed so far
+} history_snapshot_t;
+
+/**
+ * When appended records reach the disk. Records are published to readers, and
+ * history_append() returns, only after the sync the policy asks for; if that
+ * sync fails, the batch is removed from the log again and the append fails.
+ */
+typedef enum {
+    SYNC_NONE,          // Leave write-back to the kernel
+    SYNC_INTERVAL,      // fdatasync() at most every history_sync_interval_ms, and at the latest that long after a commit
+    SYNC_BATCH          // fdatasync() every group commit
+} sync_policy_t;
+
+extern sync_policy_t history_sync_policy;
+extern unsigned long history_sync_interval_ms;
+
+/**
+ * Start committed_len at the end of the existing history: what the
+ * /dev/aesdchar ring holds, or the end of the segment log after recovering
+ * its tail. Offsets in the history count every byte committed since the
+ * history began, including bytes the ring or log retention dropped since.
+ * @return 0 on success, -1 on failure
+ */
+int history_init(void);
+
+/**
+ * Release what history_init() opened, once nothing reads the history any more.
+ */
+void history_close(void);
+
+/**
+ * Append @param len bytes to FILE_PATH through @param fd and publish them.
+ * The data file build ignores @param fd, its segment log owns the files.
+ * Concurrent appends are group committed: whichever caller finds no write in
+ * progress writes every queued record with one writev() and applies
+ * history_sync_policy once for the whole batch. /dev/aesdchar ignores the
+ * policy, it has nothing to sync.
+ * @return 0 on success, -1 on failure
+ */
+int history_append(int fd, const char *data, size_t len);
+
+/**
+ * Append the @param count records in @param iov (at most HISTORY_BATCH_MAX)
+ * through the same group commit as history_append(), back to back and in
+ * order, without waiting for a round trip per record.
+ * @param end_offsets if not NULL, receives for each record the absolute
+ *      history offset just past it, 0 for records of a failed batch
+ * @return 0 on success, -1 if any record failed
+ */
+int history_appendv(int fd, const struct iovec *iov, int count, off_t *end_offsets);
+
+/**
+ * Find the history offset of byte @param write_cmd_offset of record
+ * @param write_cmd, counting newline terminated records from the oldest one
+ * retained, with the same bounds AESDCHAR_IOCSEEKTO applies. Looked up in
+ * the sparse index of the segment log, see segment_find_record(). Only in
+ * the data file build; the device answers the ioctl itself.
+ * @return 0 with the offset stored in @param offset, or -1 with errno set to
+ *      EINVAL for a record or offset out of range
+ */
+int history_find_record(unsigned int write_cmd, unsigned int write_cmd_offset, off_t *offset);
+
+/**
+ * Sync FILE_PATH unless the policy is SYNC_NONE, so records committed since
+ * the last interval sync are on disk at shutdown.
+ */
+void history_sync(void);
+
+/**
+ * Take a consistent snapshot of the committed history without locking.
+ */
+void history_snapshot(history_snapshot_t *snapshot);
+
+/**
+ * An immutable copy of the /dev/aesdchar ring, shared by every replay that
+ * asks for the same generation. The cache holds one reference on the newest
+ * view and every user holds another, so a view stays valid while any queued
+ * reply still points into it, even after appends replaced it in the cache.
+ */
+typedef struct history_view {
+    unsigned long refs;
+    history_snapshot_t snapshot;    // Committed length and generation the copy matches
+    size_t len;                     // The ring holds the last len bytes before snapshot.length
+    char *data;
+} history_view_t;
+
+/**
+ * Get a reference on a view of the history at least as new as the appends
+ * committed so far. Only the first replay after an append reads the device,
+ * through @param fd; replays arriving meanwhile wait for that copy and share
+ * it. Only in the device build, the data file is replayed with sendfile().
+ * @return the view, to be released with history_view_release(), or NULL on failure
+ */
+history_view_t *history_view_acquire(int fd);
+
+/**
+ * Drop a reference taken by history_view_acquire(), freeing the view with the last one.
+ */
+void history_view_release(history_view_t *view);
+
+/**
+ * Read @param fd until EOF into a new buffer, starting at *@param offset, or
+ * at the file position when @param offset is NULL.
+ * @return the buffer, to be freed by the caller, or NULL on failure
+ */
+char *read_to_end(int fd, off_t *offset, size_t *len);
+
+/**
+ * Log lock-free reads, seqlock retries, writer lock contention, how well
+ * appends were batched and how often replays shared a view.
+ */
+void history_log_stats(void);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include "server.h"
+#include "line_framer.h"
+#include "logger.h"
+
+void framer_free(line_framer_t *framer) {
+    free(framer->buf);
+    memset(framer, 0, sizeof(line_framer_t));
+}
+
+// Hand out every complete line of data after scan_from; glibc's memchr is vectorized
+static int split_lines(const char *data, size_t len, size_t scan_from, size_t *consumed,
+                       line_handler_t handler, void *ctx) {
+    size_t start = 0;
+    const char *newline;
+
+    while (scan_from < len && (newline = memchr(data + scan_from, '\n', len - scan_from)) != NULL) {
+        size_t line_end = newline - data + 1;
+        if (handler(ctx, data + start, line_end - start) == -1) {
+            return -1;
+        }
+        start = scan_from = line_end;
+    }
+
+    *consumed = start;
+    return 0;
+}
+
+// A client that never sends a newline would otherwise grow the buffer until memory runs out
+static int check_pending(size_t pending) {
+    if (pending > MAX_LINE_SIZE) {
+        log_msg(LOG_WARNING, "Unterminated line of %zu bytes exceeds the %d byte limit", pending, MAX_LINE_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+static int buffer_append(line_framer_t *framer, const char *data, size_t len) {
+    if (framer->end + len > framer->cap) {
+        size_t new_cap = framer->cap ? framer->cap : BUFFER_SIZE;
+        while (new_cap < framer->end + len) {
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(framer->buf, new_cap);
+        if (new_buf == NULL) {
+            log_msg(LOG_ERR, "Failed to grow line buffer: %s", strerror(errno));
+            return -1;
+        }
+        framer->buf = new_buf;
+        framer->cap = new_cap;
+    }
+
+    memcpy(framer->buf + framer->end, data, len);
+    framer->end += len;
+    return 0;
+}
+
+int framer_feed(line_framer_t *framer, const char *data, size_t len, line_handler_t handler, void *ctx) {
+    // split_lines() leaves it alone when the handler stops
+    size_t consumed = 0;
+
+    if (framer->start == framer->end) {
+        // Nothing buffered: split in place and keep only the incomplete tail
+        framer->start = framer->end = 0;
+        if (split_lines(data, len, 0, &consumed, handler, ctx) == -1 || check_pending(len - consumed) == -1) {
+            return -1;
+        }
+        return buffer_append(framer, data + consumed, len - consumed);
+    }
+
+    // Lines handed out by the previous call are no longer referenced, so compact now
+    size_t buffered = framer->end - framer->start;
+    memmove(framer->buf, framer->buf + framer->start, buffered);
+    framer->start = 0;
+    framer->end = buffered;
+
+    if (buffer_append(framer, data, len) == -1) {
+        return -1;
+    }
+
+    int ret = split_lines(framer->buf, framer->end, buffered, &consumed, handler, ctx);
+    framer->start = consumed;
+    if (ret == 0) {
+        ret = check_pending(framer->end - framer->start);
+    }
+    return ret;
+}
+
+const char *framer_pending(const line_framer_t *framer, size_t *len) {
+    *len = framer->end - framer->start;
+    return framer->buf + framer->start;
+}
@@ -0,0 +1,44 @@
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <stddef.h>
+
+/**
+ * Splits a byte stream into newline terminated lines. Only an incomplete
+ * trailing line is ever copied into buf; complete lines are handed out in
+ * place, straight from the caller's receive buffer whenever nothing is
+ * buffered. Bytes in [start, end) never contain a newline, so each byte is
+ * scanned exactly once no matter how many reads a long line spans.
+ */
+typedef struct line_framer {
+    char *buf;
+    size_t start;   // First buffered byte not handed out yet
+    size_t end;     // End of buffered data
+    size_t cap;
+} line_framer_t;
+
+/**
+ * Called for each complete line, newline included.
+ * @return 0 to continue, -1 to stop
+ */
+typedef int (*line_handler_t)(void *ctx, const char *line, size_t len);
+
+/**
+ * Release the memory held by @param framer.
+ */
+void framer_free(line_framer_t *framer);
+
+/**
+ * Feed @param len received bytes to @param framer and call @param handler for
+ * every line they complete. Lines stay valid until the next framer_feed().
+ * @return 0 on success, -1 if the handler stopped, memory ran out or the
+ * incomplete line grew past MAX_LINE_SIZE
+ */
+int framer_feed(line_framer_t *framer, const char *data, size_t len, line_handler_t handler, void *ctx);
+
+/**
+ * @return the incomplete line buffered so far and store its length in @param len
+ */
+const char *framer_pending(const line_framer_t *framer, size_t *len);
+
+#endif /* LINE_FRAMER_H */
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include "logger.h"
+#include "metrics.h"
+
+#define LOG_RING_SLOTS 128
+#define LOG_RECORD_SIZE 256
+#define LOG_DRAIN_INTERVAL_MS 20
+
+// Ring states: owned by a live thread, owner exited with records left, or drained and free to reuse
+enum {
+    RING_OWNED,
+    RING_ORPHANED,
+    RING_FREE
+};
+
+typedef struct log_record {
+    int priority;
+    char text[LOG_RECORD_SIZE - sizeof(int)];
+} log_record_t;
+
+typedef struct log_ring {
+    struct log_ring *next;          // Rings are only ever pushed, never unlinked
+    unsigned long head;             // Next record to drain, written by the drainer
+    unsigned long tail;             // Next free slot, written by the owning thread
+    int state;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+int log_level = LOG_INFO;
+
+static log_ring_t *rings = NULL;
+static __thread log_ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+
+static int logger_running = 0;
+static int logger_stopping = 0;
+static pthread_t drainer_thread;
+static pthread_mutex_t drainer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drainer_cond;
+
+// Thread exit: the drainer empties the ring and marks it free
+static void release_ring(void *arg) {
+    log_ring_t *ring = arg;
+
+    __atomic_store_n(&ring->state, RING_ORPHANED, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *get_ring(void) {
+    log_ring_t *ring;
+
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    // Adopt the ring of a thread that is gone before allocating another
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int expected = RING_FREE;
+        if (__atomic_compare_exchange_n(&ring->state, &expected, RING_OWNED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void log_msg(int priority, const char *format, ...) {
+    va_list args;
+
+    if (LOG_PRI(priority) > log_level) {
+        return;
+    }
+
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+        va_start(args, format);
+        vsyslog(priority, format, args);
+        va_end(args);
+        return;
+    }
+
+    log_ring_t *ring = get_ring();
+    if (ring == NULL || ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        METRIC_ADD(log_dropped, 1);
+        return;
+    }
+
+    log_record_t *record = &ring->records[ring->tail % LOG_RING_SLOTS];
+    record->priority = priority;
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+    // A burst should not wait for the next drain interval; signalling is cheap when nobody waits
+    if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == LOG_RING_SLOTS / 2) {
+        pthread_cond_signal(&drainer_cond);
+    }
+}
+
+static void drain_rings(void) {
+    for (log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        // Read the state first: once it says orphaned, the tail read after it is final
+        int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        for (unsigned long head = ring->head; head != tail; head++) {
+            log_record_t *record = &ring->records[head % LOG_RING_SLOTS];
+            syslog(record->priority, "%s", record->text);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        if (state == RING_ORPHANED) {
+            __atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void *drainer_loop(void *arg) {
+    unsigned long reported_drops = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&drainer_mutex);
+    while (1) {
+        int stopping = logger_stopping;
+        pthread_mutex_unlock(&drainer_mutex);
+
+        drain_rings();
+
+        unsigned long drops = METRIC_GET(log_dropped);
+        if (drops != reported_drops) {
+            syslog(LOG_WARNING, "Log rings full, %lu messages dropped so far", drops);
+            reported_drops = drops;
+        }
+
+        pthread_mutex_lock(&drainer_mutex);
+        if (stopping) {
+            break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!logger_stopping) {
+            pthread_cond_timedwait(&drainer_cond, &drainer_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&drainer_mutex);
+    return NULL;
+}
+
+int logger_start(void) {
+    pthread_condattr_t attr;
+
+    if (pthread_key_create(&ring_key, release_ring) != 0) {
+        syslog(LOG_ERR, "Failed to create logger key");
+        return -1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&drainer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    logger_stopping = 0;
+    if (pthread_create(&drainer_thread, NULL, drainer_loop, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create logger thread");
+        return -1;
+    }
+
+    __atomic_store_n(&logger_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void logger_stop(void) {
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // Callers from here on log synchronously; the final pass picks up what is queued
+    __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&drainer_mutex);
+    logger_stopping = 1;
+    pthread_cond_signal(&drainer_cond);
+    pthread_mutex_unlock(&drainer_mutex);
+
+    pthread_join(drainer_thread, NULL);
+}
@@ -0,0 +1,35 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <syslog.h>
+
+/**
+ * Asynchronous front end to syslog(). Each thread formats its messages into
+ * its own single-producer ring, and one drainer thread hands them to syslog()
+ * in the background, so a connection path never waits on the syslog socket.
+ * When a ring is full the message is dropped and counted in
+ * metrics.log_dropped instead of stalling the caller. Rings of threads that
+ * exited are drained and then reused by new threads.
+ */
+
+// Messages less important than this syslog priority are discarded before formatting
+extern int log_level;
+
+/**
+ * Start the drainer thread. Messages logged before are written synchronously.
+ * @return 0 on success, -1 on failure
+ */
+int logger_start(void);
+
+/**
+ * Drain every ring and stop the drainer thread; later messages are written
+ * synchronously again. Call once the threads that log are done.
+ */
+void logger_stop(void);
+
+/**
+ * Queue a syslog message of @param priority. Not async-signal-safe.
+ */
+void log_msg(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LOGGER_H */
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <time.h>
+#include "metrics.h"
+
+metrics_t metrics;
+
+uint64_t metrics_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Values below HIST_SUB_BUCKETS get exact buckets, above that the top HIST_SUB_BITS + 1 bits pick one
+static unsigned int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+
+    unsigned int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Largest value that lands in bucket @param index
+static uint64_t bucket_upper(unsigned int index) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+
+    unsigned int shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(histogram_t *hist, uint64_t value_ns) {
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&hist->counts[bucket_index(value_ns)], 1, __ATOMIC_RELAXED);
+    while (value_ns > max &&
+           !__atomic_compare_exchange_n(&hist->max, &max, value_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t histogram_percentile(const histogram_t *hist, unsigned int permille) {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total = 0;
+
+    // Work on a copy so the rank and the walk agree while other threads keep recording
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    unsigned long rank = (total * permille + 999) / 1000;
+    unsigned long seen = 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank && counts[i] != 0) {
+            uint64_t upper = bucket_upper(i);
+            uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+            return upper < max ? upper : max;
+        }
+    }
+    return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+static size_t format_histogram(char *buf, size_t size, const char *name, const histogram_t *hist) {
+    unsigned long count = 0;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        count += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+    }
+
+    int written = snprintf(buf, size, "%s_us count=%lu p50=%.1f p99=%.1f p999=%.1f max=%.1f\n", name, count,
+                           histogram_percentile(hist, 500) / 1000.0,
+                           histogram_percentile(hist, 990) / 1000.0,
+                           histogram_percentile(hist, 999) / 1000.0,
+                           __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1000.0);
+    if (written < 0) {
+        return 0;
+    }
+    return (size_t)written < size ? (size_t)written : size - 1;
+}
+
+size_t metrics_format(char *buf, size_t size) {
+    size_t len;
+    int written = snprintf(buf, size,
+                           "connections %lu\n"
+                           "active_connections %lu\n"
+                           "bytes_in %lu\n"
+                           "bytes_out %lu\n"
+                           "send_calls %lu\n"
+                           "records_appended %lu\n"
+                           "replays_served %lu\n"
+                           "subscribers %lu\n"
+                           "pushes %lu\n"
+                           "file_mutex_wait_us %lu\n"
+                           "log_dropped %lu\n",
+                           METRIC_GET(connections),
+                           METRIC_GET(active_connections),
+                           METRIC_GET(bytes_in),
+                           METRIC_GET(bytes_out),
+                           METRIC_GET(send_calls),
+                           METRIC_GET(records_appended),
+                           METRIC_GET(replays_served),
+                           METRIC_GET(subscribers),
+                           METRIC_GET(pushes),
+                           METRIC_GET(file_mutex_wait_ns) / 1000,
+                           METRIC_GET(log_dropped));
+    if (written < 0) {
+        return 0;
+    }
+    len = (size_t)written < size ? (size_t)written : size - 1;
+
+    len += format_histogram(buf + len, size - len, "append_latency", &metrics.append_latency);
+    len += format_histogram(buf + len, size - len, "replay_latency", &metrics.replay_latency);
+    return len;
+}
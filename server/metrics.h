@@ -0,0 +1,71 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Log-linear latency histogram in the style of HdrHistogram: every power of
+ * two is split into HIST_SUB_BUCKETS linear buckets, so any recorded value is
+ * reported within 1/HIST_SUB_BUCKETS of itself whatever its magnitude.
+ * Recording is a single relaxed atomic increment, safe from any thread.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    uint64_t max;
+} histogram_t;
+
+/**
+ * Process-wide counters. Fields are only updated with METRIC_ADD and read with
+ * METRIC_GET, so every engine and worker thread can bump them without a lock.
+ */
+typedef struct metrics {
+    unsigned long connections;          // Accepted since start
+    unsigned long active_connections;
+    unsigned long bytes_in;             // Received from clients
+    unsigned long bytes_out;            // Sent to clients
+    unsigned long send_calls;           // Syscalls or io_uring sends used for bytes_out
+    unsigned long records_appended;     // Lines stored in FILE_PATH
+    unsigned long replays_served;
+    unsigned long subscribers;          // Connections following new records
+    unsigned long pushes;               // New records pushed to a subscriber, one per send batch
+    unsigned long file_mutex_wait_ns;   // Time spent blocked on a contended file_mutex
+    unsigned long log_dropped;          // Log messages lost to a full logger ring
+    histogram_t append_latency;         // history_append(), including the group commit wait
+    histogram_t replay_latency;         // Building and queueing one replay
+} metrics_t;
+
+extern metrics_t metrics;
+
+#define METRIC_ADD(field, n) __atomic_add_fetch(&metrics.field, (n), __ATOMIC_RELAXED)
+#define METRIC_SUB(field, n) __atomic_sub_fetch(&metrics.field, (n), __ATOMIC_RELAXED)
+#define METRIC_GET(field) __atomic_load_n(&metrics.field, __ATOMIC_RELAXED)
+
+/**
+ * @return CLOCK_MONOTONIC in nanoseconds, for measuring latencies
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * Record one sample of @param value_ns in @param hist.
+ */
+void histogram_record(histogram_t *hist, uint64_t value_ns);
+
+/**
+ * @return the smallest recorded value at or above @param permille of the
+ *      samples (500 for p50, 999 for p99.9), or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(const histogram_t *hist, unsigned int permille);
+
+/**
+ * Format every counter and histogram as "name value" lines into @param buf,
+ * the reply to the AESDSOCKET_STATS command.
+ * @return the length written, truncated to @param size - 1
+ */
+size_t metrics_format(char *buf, size_t size);
+
+#endif /* METRICS_H */
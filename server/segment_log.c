@@ -0,0 +1,856 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <endian.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include "server.h"
+#include "segment_log.h"
+#include "crc32c.h"
+#include "timer_wheel.h"
+#include "logger.h"
+
+#define SEGMENT_NAME_SIZE 64
+#define SEGMENT_MAX_IOV 64
+#define MIGRATE_BATCH_BYTES 65536       // Largest index batch written for a migrated history file
+#define MIGRATE_PATH FILE_PATH ".migrate"
+
+/**
+ * One index entry as stored in <base>.idx, all fields little endian.
+ */
+typedef struct index_entry {
+    uint64_t offset;            // History offset of the first byte of the batch
+    uint64_t first_record;      // Records terminated before the batch
+    uint32_t length;            // Bytes in the batch
+    uint32_t records;           // Newlines in the batch
+    uint32_t data_crc;          // CRC32C of the batch bytes
+    uint32_t entry_crc;         // CRC32C of the fields above
+} index_entry_t;
+
+_Static_assert(sizeof(index_entry_t) == 32, "index entries are 32 bytes on disk");
+
+struct log_segment {
+    TAILQ_ENTRY(log_segment) entries;
+    off_t base;                 // History offset of the first byte
+    off_t size;                 // Bytes in the data file; only the tail's grows
+    uint64_t first_record;      // Records terminated before the segment
+    int first_record_known;     // Read from the index on first use for recovered segments
+    int fd;                     // Data file, open while it is the tail or referenced
+    unsigned int refs;          // Queued replies reading from it
+    int removed;                // Deleted by retention, freed with its last reference
+};
+
+size_t segment_bytes = SEGMENT_DEFAULT_BYTES;
+unsigned long long retain_bytes = 0;
+unsigned long retain_seconds = 0;
+
+// log_mutex protects the list, references, fds of non-tail segments and the totals below
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(segment_list, log_segment) segments = TAILQ_HEAD_INITIALIZER(segments);
+static log_segment_t *tail = NULL;
+static int index_fd = -1;               // The tail's index, written under file_mutex, replaced under both
+static size_t tail_entries = 0;         // Changed under both mutexes, like index_fd
+static off_t log_end = 0;
+static off_t log_start = 0;
+static uint64_t total_records = 0;
+static size_t last_batch_len = 0;       // The last append, for segment_undo_append(); under file_mutex
+static uint32_t last_batch_records = 0;
+static wheel_timer_t retention_timer;
+
+static void segment_path(char *path, off_t base, const char *suffix) {
+    snprintf(path, SEGMENT_NAME_SIZE + sizeof(FILE_PATH), "%s/%020lld.%s", FILE_PATH, (long long)base, suffix);
+}
+
+static void encode_entry(index_entry_t *entry, off_t offset, uint64_t first_record, uint32_t length,
+                         uint32_t records, uint32_t data_crc) {
+    entry->offset = htole64(offset);
+    entry->first_record = htole64(first_record);
+    entry->length = htole32(length);
+    entry->records = htole32(records);
+    entry->data_crc = htole32(data_crc);
+    entry->entry_crc = htole32(crc32c(0, entry, offsetof(index_entry_t, entry_crc)));
+}
+
+// Convert @param entry to host order in place; returns 0 if its CRC checks out
+static int decode_entry(index_entry_t *entry) {
+    if (le32toh(entry->entry_crc) != crc32c(0, entry, offsetof(index_entry_t, entry_crc))) {
+        return -1;
+    }
+    entry->offset = le64toh(entry->offset);
+    entry->first_record = le64toh(entry->first_record);
+    entry->length = le32toh(entry->length);
+    entry->records = le32toh(entry->records);
+    entry->data_crc = le32toh(entry->data_crc);
+    return 0;
+}
+
+static int read_entry(int fd, size_t index, index_entry_t *entry) {
+    if (pread(fd, entry, sizeof(*entry), index * sizeof(*entry)) != sizeof(*entry)) {
+        return -1;
+    }
+    return decode_entry(entry);
+}
+
+static int read_exact(int fd, char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t bytes_read = pread(fd, data, len, offset);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += bytes_read;
+        len -= bytes_read;
+        offset += bytes_read;
+    }
+    return 0;
+}
+
+// Write all of @param iov, advancing past partial writes
+static int write_batch(int fd, const struct iovec *iov, int count) {
+    struct iovec local[SEGMENT_MAX_IOV];
+    struct iovec *pending = local;
+
+    memcpy(local, iov, count * sizeof(struct iovec));
+    while (count > 0) {
+        ssize_t written = writev(fd, pending, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        while (count > 0 && (size_t)written >= pending->iov_len) {
+            written -= pending->iov_len;
+            pending++;
+            count--;
+        }
+        if (count > 0) {
+            pending->iov_base = (char *)pending->iov_base + written;
+            pending->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int open_segment_file(off_t base, const char *suffix, int flags) {
+    char path[SEGMENT_NAME_SIZE + sizeof(FILE_PATH)];
+
+    segment_path(path, base, suffix);
+    int fd = open(path, flags, 0644);
+    if (fd == -1) {
+        log_msg(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+static void sync_directory(void) {
+    int fd = open(FILE_PATH, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static log_segment_t *new_segment(off_t base) {
+    log_segment_t *segment = calloc(1, sizeof(log_segment_t));
+    if (segment == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate segment: %s", strerror(errno));
+        return NULL;
+    }
+    segment->base = base;
+    segment->fd = -1;
+    return segment;
+}
+
+// Make a new empty segment at log_end the tail; file_mutex is held
+static int start_segment(void) {
+    log_segment_t *segment = new_segment(log_end);
+    if (segment == NULL) {
+        return -1;
+    }
+    segment->first_record = total_records;
+    segment->first_record_known = 1;
+
+    segment->fd = open_segment_file(log_end, "log", O_RDWR | O_APPEND | O_CREAT | O_TRUNC);
+    int new_index_fd = open_segment_file(log_end, "idx", O_RDWR | O_APPEND | O_CREAT | O_TRUNC);
+    if (segment->fd == -1 || new_index_fd == -1) {
+        if (segment->fd != -1) {
+            close(segment->fd);
+        }
+        free(segment);
+        return -1;
+    }
+    sync_directory();
+
+    pthread_mutex_lock(&log_mutex);
+    if (tail != NULL && tail->refs == 0) {
+        // The old tail's data file is reopened when a replay reaches it
+        close(tail->fd);
+        tail->fd = -1;
+    }
+    TAILQ_INSERT_TAIL(&segments, segment, entries);
+    tail = segment;
+
+    // Record lookups hold only log_mutex and must see the tail together with its index
+    if (index_fd != -1) {
+        close(index_fd);
+    }
+    index_fd = new_index_fd;
+    tail_entries = 0;
+    pthread_mutex_unlock(&log_mutex);
+    return 0;
+}
+
+// Unlink the oldest segment; log_mutex is held and it is not the tail
+static void remove_segment(log_segment_t *segment) {
+    char path[SEGMENT_NAME_SIZE + sizeof(FILE_PATH)];
+
+    segment_path(path, segment->base, "log");
+    unlink(path);
+    segment_path(path, segment->base, "idx");
+    unlink(path);
+    log_msg(LOG_INFO, "Retention removed segment at offset %lld", (long long)segment->base);
+
+    TAILQ_REMOVE(&segments, segment, entries);
+    __atomic_store_n(&log_start, TAILQ_FIRST(&segments)->base, __ATOMIC_RELAXED);
+
+    // Replies still queued from it keep reading the unlinked file
+    segment->removed = 1;
+    if (segment->refs == 0) {
+        if (segment->fd != -1) {
+            close(segment->fd);
+        }
+        free(segment);
+    }
+}
+
+// Delete the oldest segments beyond retain_bytes or retain_seconds; log_mutex is held
+static void enforce_retention(void) {
+    log_segment_t *oldest;
+    time_t now = time(NULL);
+
+    while ((oldest = TAILQ_FIRST(&segments)) != tail) {
+        int expired = retain_bytes != 0 && (unsigned long long)(log_end - oldest->base) > retain_bytes;
+
+        if (!expired && retain_seconds != 0) {
+            char path[SEGMENT_NAME_SIZE + sizeof(FILE_PATH)];
+            struct stat st;
+
+            segment_path(path, oldest->base, "log");
+            expired = stat(path, &st) == 0 && now - st.st_mtime > (time_t)retain_seconds;
+        }
+        if (!expired) {
+            break;
+        }
+        remove_segment(oldest);
+    }
+}
+
+static void retention_expired(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&log_mutex);
+    enforce_retention();
+    pthread_mutex_unlock(&log_mutex);
+
+    timer_arm(&retention_timer, SEGMENT_RETENTION_CHECK_MS);
+}
+
+void segment_retention_start(void) {
+    if (retain_seconds != 0) {
+        timer_init(&retention_timer, retention_expired, NULL);
+        timer_arm(&retention_timer, SEGMENT_RETENTION_CHECK_MS);
+    }
+}
+
+// Seal the full tail and start the next segment; file_mutex is held
+static int roll_segment(void) {
+    // Everything before the tail must be complete, recovery only checks the tail
+    if (fdatasync(tail->fd) == -1 || fdatasync(index_fd) == -1) {
+        log_msg(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        return -1;
+    }
+    if (start_segment() == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    enforce_retention();
+    pthread_mutex_unlock(&log_mutex);
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    off_t left = *(const off_t *)a, right = *(const off_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+// Collect the base offsets of the segments in FILE_PATH, in order
+static int list_segments(off_t **bases, size_t *count) {
+    size_t cap = 0;
+    struct dirent *dirent;
+    DIR *dir = opendir(FILE_PATH);
+
+    *bases = NULL;
+    *count = 0;
+    if (dir == NULL) {
+        log_msg(LOG_ERR, "Failed to open %s: %s", FILE_PATH, strerror(errno));
+        return -1;
+    }
+
+    while ((dirent = readdir(dir)) != NULL) {
+        char *end;
+        long long base = strtoll(dirent->d_name, &end, 10);
+        if (end == dirent->d_name || strcmp(end, ".log") != 0 || base < 0) {
+            continue;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            off_t *grown = realloc(*bases, cap * sizeof(off_t));
+            if (grown == NULL) {
+                log_msg(LOG_ERR, "Failed to list segments: %s", strerror(errno));
+                closedir(dir);
+                free(*bases);
+                return -1;
+            }
+            *bases = grown;
+        }
+        (*bases)[(*count)++] = base;
+    }
+    closedir(dir);
+
+    qsort(*bases, *count, sizeof(off_t), compare_offsets);
+    return 0;
+}
+
+/**
+ * Keep the longest prefix of the tail whose index entries and data check
+ * out and truncate the rest, which a crash left half written.
+ */
+static int recover_tail(void) {
+    struct stat st;
+    index_entry_t entry;
+    size_t valid = 0;
+    off_t valid_len = 0;
+    char *data = NULL;
+    size_t data_cap = 0;
+
+    tail->fd = open_segment_file(tail->base, "log", O_RDWR | O_APPEND | O_CREAT);
+    index_fd = open_segment_file(tail->base, "idx", O_RDWR | O_APPEND | O_CREAT);
+    if (tail->fd == -1 || index_fd == -1 || fstat(index_fd, &st) == -1) {
+        return -1;
+    }
+
+    size_t entries = st.st_size / sizeof(index_entry_t);
+    for (; valid < entries; valid++) {
+        if (read_entry(index_fd, valid, &entry) == -1 || entry.offset != (uint64_t)(tail->base + valid_len) ||
+            (valid > 0 && entry.first_record != total_records)) {
+            break;
+        }
+        if (entry.length > data_cap) {
+            char *grown = realloc(data, entry.length);
+            if (grown == NULL) {
+                break;
+            }
+            data = grown;
+            data_cap = entry.length;
+        }
+        if (read_exact(tail->fd, data, entry.length, valid_len) == -1 ||
+            crc32c(0, data, entry.length) != entry.data_crc) {
+            break;
+        }
+
+        if (valid == 0) {
+            tail->first_record = entry.first_record;
+            tail->first_record_known = 1;
+        }
+        valid_len += entry.length;
+        total_records = entry.first_record + entry.records;
+    }
+    free(data);
+
+    if (fstat(tail->fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size != valid_len || valid < entries) {
+        log_msg(LOG_WARNING, "Recovered segment %lld: kept %lld bytes in %zu batches, dropped %lld bytes",
+                (long long)tail->base, (long long)valid_len, valid, (long long)(st.st_size - valid_len));
+        if (ftruncate(tail->fd, valid_len) == -1 ||
+            ftruncate(index_fd, valid * sizeof(index_entry_t)) == -1) {
+            log_msg(LOG_ERR, "Failed to truncate segment: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    tail->size = valid_len;
+    tail_entries = valid;
+    return 0;
+}
+
+// Records before an empty tail are those of the segment before it, which is complete
+static void count_records_before_tail(void) {
+    log_segment_t *previous = TAILQ_PREV(tail, segment_list, entries);
+    index_entry_t entry;
+    struct stat st;
+
+    total_records = 0;
+    if (previous != NULL) {
+        int fd = open_segment_file(previous->base, "idx", O_RDONLY);
+        if (fd != -1) {
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(entry) &&
+                read_entry(fd, st.st_size / sizeof(entry) - 1, &entry) == 0) {
+                total_records = entry.first_record + entry.records;
+            }
+            close(fd);
+        }
+    }
+    tail->first_record = total_records;
+    tail->first_record_known = 1;
+}
+
+// Write the index of the migrated data file @param data_fd, in batches that end at a newline where possible
+static int index_migrated_file(int data_fd, int fd) {
+    char *data = malloc(MIGRATE_BATCH_BYTES);
+    off_t offset = 0;
+    uint64_t records = 0;
+    struct stat st;
+    int ret = -1;
+
+    if (data == NULL || fstat(data_fd, &st) == -1) {
+        log_msg(LOG_ERR, "Failed to index %s: %s", MIGRATE_PATH, strerror(errno));
+        free(data);
+        return -1;
+    }
+
+    while (offset < st.st_size) {
+        size_t len = st.st_size - offset < MIGRATE_BATCH_BYTES ? st.st_size - offset : MIGRATE_BATCH_BYTES;
+        uint32_t batch_records = 0;
+        index_entry_t entry;
+
+        if (read_exact(data_fd, data, len, offset) == -1) {
+            log_msg(LOG_ERR, "Failed to read %s: %s", MIGRATE_PATH, strerror(errno));
+            goto out;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] == '\n') {
+                batch_records++;
+            }
+        }
+        // A record longer than a batch simply spans several
+        if (batch_records > 0 && data[len - 1] != '\n') {
+            while (data[len - 1] != '\n') {
+                len--;
+            }
+        }
+
+        encode_entry(&entry, offset, records, len, batch_records, crc32c(0, data, len));
+        if (write_batch(fd, &(struct iovec){ .iov_base = &entry, .iov_len = sizeof(entry) }, 1) == -1) {
+            log_msg(LOG_ERR, "Failed to write index: %s", strerror(errno));
+            goto out;
+        }
+        offset += len;
+        records += batch_records;
+    }
+    ret = fdatasync(fd);
+
+out:
+    free(data);
+    return ret;
+}
+
+/**
+ * Earlier versions kept the history in the single file FILE_PATH. Its bytes
+ * become the segment at offset 0: the file is moved aside, indexed, then
+ * moved into the new directory, so an interrupted migration resumes from
+ * MIGRATE_PATH on the next start.
+ */
+static int migrate_history_file(void) {
+    char path[SEGMENT_NAME_SIZE + sizeof(FILE_PATH)];
+    struct stat st;
+
+    if (stat(FILE_PATH, &st) == 0 && !S_ISDIR(st.st_mode) && rename(FILE_PATH, MIGRATE_PATH) == -1) {
+        log_msg(LOG_ERR, "Failed to move %s aside: %s", FILE_PATH, strerror(errno));
+        return -1;
+    }
+    if (stat(MIGRATE_PATH, &st) == -1) {
+        return 0;
+    }
+    if (mkdir(FILE_PATH, 0755) == -1 && errno != EEXIST) {
+        log_msg(LOG_ERR, "Failed to create %s: %s", FILE_PATH, strerror(errno));
+        return -1;
+    }
+
+    int data_fd = open(MIGRATE_PATH, O_RDONLY);
+    int fd = open_segment_file(0, "idx", O_WRONLY | O_CREAT | O_TRUNC);
+    int ret = data_fd == -1 || fd == -1 ? -1 : index_migrated_file(data_fd, fd);
+    if (data_fd != -1) {
+        close(data_fd);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    segment_path(path, 0, "log");
+    if (ret == -1 || rename(MIGRATE_PATH, path) == -1) {
+        log_msg(LOG_ERR, "Failed to migrate %s, left at %s", FILE_PATH, MIGRATE_PATH);
+        return -1;
+    }
+    sync_directory();
+
+    log_msg(LOG_INFO, "Migrated %lld bytes of history from the single file %s", (long long)st.st_size, FILE_PATH);
+    return 0;
+}
+
+int segment_log_open(off_t *end) {
+    off_t *bases;
+    size_t count;
+
+    if (migrate_history_file() == -1) {
+        return -1;
+    }
+    if (mkdir(FILE_PATH, 0755) == -1 && errno != EEXIST) {
+        log_msg(LOG_ERR, "Failed to create %s: %s", FILE_PATH, strerror(errno));
+        return -1;
+    }
+
+    if (list_segments(&bases, &count) == -1) {
+        return -1;
+    }
+    if (count == 0) {
+        free(bases);
+        *end = 0;
+        return start_segment();
+    }
+
+    // Sizes of sealed segments follow from the next base, their files are not touched
+    for (size_t i = 0; i < count; i++) {
+        log_segment_t *segment = new_segment(bases[i]);
+        if (segment == NULL) {
+            free(bases);
+            return -1;
+        }
+        if (i + 1 < count) {
+            segment->size = bases[i + 1] - bases[i];
+        }
+        TAILQ_INSERT_TAIL(&segments, segment, entries);
+    }
+    free(bases);
+
+    tail = TAILQ_LAST(&segments, segment_list);
+    if (recover_tail() == -1) {
+        return -1;
+    }
+    if (tail_entries == 0) {
+        count_records_before_tail();
+    }
+
+    log_end = tail->base + tail->size;
+    log_start = TAILQ_FIRST(&segments)->base;
+    enforce_retention();
+
+    log_msg(LOG_INFO, "Opened %zu segments holding history [%lld, %lld), %llu records",
+            count, (long long)log_start, (long long)log_end, (unsigned long long)total_records);
+    *end = log_end;
+    return 0;
+}
+
+void segment_log_close(void) {
+    log_segment_t *segment;
+
+    while ((segment = TAILQ_FIRST(&segments)) != NULL) {
+        TAILQ_REMOVE(&segments, segment, entries);
+        if (segment->fd != -1) {
+            close(segment->fd);
+        }
+        free(segment);
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    tail = NULL;
+}
+
+int segment_append(const struct iovec *iov, int count) {
+    index_entry_t entry;
+    uint32_t crc = 0;
+    uint32_t records = 0;
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++) {
+        const char *data = iov[i].iov_base;
+        const char *newline;
+        size_t scan = 0;
+
+        crc = crc32c(crc, data, iov[i].iov_len);
+        while (scan < iov[i].iov_len && (newline = memchr(data + scan, '\n', iov[i].iov_len - scan)) != NULL) {
+            records++;
+            scan = newline - data + 1;
+        }
+        len += iov[i].iov_len;
+    }
+
+    if (tail->size > 0 && tail->size + len > segment_bytes && roll_segment() == -1) {
+        return -1;
+    }
+
+    encode_entry(&entry, log_end, total_records, len, records, crc);
+    if (write_batch(tail->fd, iov, count) == -1 ||
+        write_batch(index_fd, &(struct iovec){ .iov_base = &entry, .iov_len = sizeof(entry) }, 1) == -1) {
+        log_msg(LOG_ERR, "Failed to write segment: %s", strerror(errno));
+        // Leave no partial batch behind, it would only be cut off by the next recovery
+        if (ftruncate(tail->fd, tail->size) == -1 ||
+            ftruncate(index_fd, tail_entries * sizeof(index_entry_t)) == -1) {
+            log_msg(LOG_ERR, "Failed to truncate segment: %s", strerror(errno));
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    tail->size += len;
+    tail_entries++;
+    log_end += len;
+    total_records += records;
+    pthread_mutex_unlock(&log_mutex);
+
+    last_batch_len = len;
+    last_batch_records = records;
+    return 0;
+}
+
+int segment_undo_append(void) {
+    int ret = 0;
+
+    // A segment rolled over for the batch stays the tail, just empty again
+    pthread_mutex_lock(&log_mutex);
+    tail->size -= last_batch_len;
+    tail_entries--;
+    log_end -= last_batch_len;
+    total_records -= last_batch_records;
+    pthread_mutex_unlock(&log_mutex);
+
+    if (ftruncate(tail->fd, tail->size) == -1 ||
+        ftruncate(index_fd, tail_entries * sizeof(index_entry_t)) == -1) {
+        log_msg(LOG_ERR, "Failed to truncate segment: %s", strerror(errno));
+        ret = -1;
+    }
+
+    last_batch_len = 0;
+    last_batch_records = 0;
+    return ret;
+}
+
+int segment_sync(void) {
+    if (fdatasync(tail->fd) == -1 || fdatasync(index_fd) == -1) {
+        log_msg(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+log_segment_t *segment_acquire(off_t offset, off_t *file_offset, size_t *avail) {
+    log_segment_t *segment;
+
+    pthread_mutex_lock(&log_mutex);
+    // Replays mostly read the newest history, so search from the tail
+    TAILQ_FOREACH_REVERSE(segment, &segments, segment_list, entries) {
+        if (segment->base <= offset) {
+            break;
+        }
+    }
+    if (segment != NULL && segment->fd == -1) {
+        segment->fd = open_segment_file(segment->base, "log", O_RDONLY);
+    }
+    if (segment == NULL || segment->fd == -1) {
+        pthread_mutex_unlock(&log_mutex);
+        return NULL;
+    }
+
+    segment->refs++;
+    *file_offset = offset - segment->base;
+    *avail = segment == tail ? SIZE_MAX : (size_t)(segment->base + segment->size - offset);
+    pthread_mutex_unlock(&log_mutex);
+    return segment;
+}
+
+void segment_release(log_segment_t *segment) {
+    pthread_mutex_lock(&log_mutex);
+    if (--segment->refs == 0 && segment != tail) {
+        close(segment->fd);
+        segment->fd = -1;
+        if (segment->removed) {
+            free(segment);
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+int segment_fd(const log_segment_t *segment) {
+    return segment->fd;
+}
+
+off_t segment_log_start(void) {
+    return __atomic_load_n(&log_start, __ATOMIC_RELAXED);
+}
+
+// Number of records terminated before @param segment; log_mutex is held
+static int segment_first_record(log_segment_t *segment, uint64_t *first_record) {
+    if (!segment->first_record_known) {
+        index_entry_t entry;
+        int fd = open_segment_file(segment->base, "idx", O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+        int ret = read_entry(fd, 0, &entry);
+        close(fd);
+        if (ret == -1) {
+            errno = EIO;
+            return -1;
+        }
+        segment->first_record = entry.first_record;
+        segment->first_record_known = 1;
+    }
+
+    *first_record = segment->first_record;
+    return 0;
+}
+
+/**
+ * Find the history offset just past the newline ending record @param record:
+ * pick the segment, binary search its index for the batch, then scan only
+ * that batch. log_mutex is held.
+ */
+static int record_end(uint64_t record, off_t *end) {
+    log_segment_t *segment;
+    uint64_t first_record = 0;
+    index_entry_t entry;
+    struct stat st;
+    int ret = -1;
+
+    TAILQ_FOREACH_REVERSE(segment, &segments, segment_list, entries) {
+        if (segment_first_record(segment, &first_record) == -1) {
+            return -1;
+        }
+        if (first_record <= record) {
+            break;
+        }
+    }
+    if (segment == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = segment == tail ? index_fd : open_segment_file(segment->base, "idx", O_RDONLY);
+    int data_fd = segment->fd != -1 ? segment->fd : open_segment_file(segment->base, "log", O_RDONLY);
+    if (fd == -1 || data_fd == -1) {
+        goto out;
+    }
+
+    // The tail's index may be ahead of what the entries count covers, never behind
+    size_t entries = tail_entries;
+    if (segment != tail) {
+        if (fstat(fd, &st) == -1) {
+            goto out;
+        }
+        entries = st.st_size / sizeof(index_entry_t);
+    }
+
+    // Last batch starting at or before the record, entries are ordered by first_record
+    size_t low = 0, high = entries;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (read_entry(fd, middle, &entry) == -1) {
+            errno = EIO;
+            goto out;
+        }
+        if (entry.first_record <= record) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    if (entries == 0 || read_entry(fd, low, &entry) == -1 || record >= entry.first_record + entry.records) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    char *data = malloc(entry.length);
+    if (data == NULL || read_exact(data_fd, data, entry.length, entry.offset - segment->base) == -1) {
+        free(data);
+        errno = EIO;
+        goto out;
+    }
+
+    // Sealed segments are not validated at startup, so the batch may not match its entry
+    uint64_t skip = record - entry.first_record;
+    const char *scan = data;
+    for (uint64_t i = 0; i <= skip && scan != NULL; i++) {
+        scan = memchr(scan, '\n', data + entry.length - scan);
+        scan = scan != NULL ? scan + 1 : NULL;
+    }
+    if (scan == NULL || crc32c(0, data, entry.length) != entry.data_crc) {
+        free(data);
+        errno = EIO;
+        goto out;
+    }
+    *end = entry.offset + (scan - data);
+    free(data);
+    ret = 0;
+
+out:
+    if (fd != -1 && fd != index_fd) {
+        close(fd);
+    }
+    if (data_fd != -1 && data_fd != segment->fd) {
+        close(data_fd);
+    }
+    return ret;
+}
+
+int segment_find_record(unsigned int write_cmd, unsigned int write_cmd_offset, off_t *offset) {
+    uint64_t first_record;
+    off_t start, end;
+    int ret = -1;
+
+    // Seeks are rare, so the lookup I/O simply runs under log_mutex
+    pthread_mutex_lock(&log_mutex);
+    if (segment_first_record(TAILQ_FIRST(&segments), &first_record) == -1) {
+        goto out;
+    }
+
+    uint64_t record = first_record + write_cmd;
+    if (record >= total_records) {
+        errno = EINVAL;
+        goto out;
+    }
+    if (record_end(record, &end) == -1) {
+        goto out;
+    }
+
+    // The oldest record may have started in a segment retention already removed
+    start = log_start;
+    if (write_cmd > 0 && record_end(record - 1, &start) == -1) {
+        goto out;
+    }
+
+    // Same bound as the driver: the offset may point just past the record
+    if (write_cmd_offset > end - start) {
+        errno = EINVAL;
+        goto out;
+    }
+    *offset = start + write_cmd_offset;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&log_mutex);
+    return ret;
+}
@@ -0,0 +1,110 @@
+#ifndef SEGMENT_LOG_H
+#define SEGMENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * The data file build keeps the history as a directory of append-only
+ * segments at FILE_PATH. Segment <base>.log holds the history bytes from
+ * offset base up to the next segment's base verbatim, so replays stay
+ * sendfile() ranges. Next to it, <base>.idx is a sparse index with one
+ * CRC32C-checked entry per group commit: where the batch starts, how long it
+ * is, how many records it ends and the CRC32C of its bytes.
+ *
+ * A new segment is started when the tail would grow past segment_bytes, and
+ * a full segment is synced before the next one is created, so only the tail
+ * can be torn by a crash. Startup lists the directory and validates the tail
+ * against its index, truncating whatever does not check out; older segments
+ * are not read until a replay or seek reaches them, so restart time does not
+ * depend on how much history is kept.
+ */
+#define SEGMENT_DEFAULT_BYTES (16 * 1024 * 1024)
+#define SEGMENT_RETENTION_CHECK_MS 60000
+
+extern size_t segment_bytes;            // Roll over to a new segment at this size
+extern unsigned long long retain_bytes; // Delete the oldest segments past this much history, 0 for no limit
+extern unsigned long retain_seconds;    // Delete segments not written for this long, 0 for no limit
+
+typedef struct log_segment log_segment_t;
+
+/**
+ * Open the segment directory at FILE_PATH, creating it if needed, and
+ * recover the tail segment.
+ * @param end receives the history offset just past the last valid byte
+ * @return 0 on success, -1 on failure
+ */
+int segment_log_open(off_t *end);
+
+/**
+ * Close every segment. No segment may be referenced any more.
+ */
+void segment_log_close(void);
+
+/**
+ * Write the @param count buffers of @param iov as one batch at the end of the
+ * tail segment and add its index entry, rolling over to a new segment first
+ * if the batch does not fit. Either the whole batch is stored or none of it.
+ * The caller holds file_mutex.
+ * @return 0 on success, -1 on failure
+ */
+int segment_append(const struct iovec *iov, int count);
+
+/**
+ * Take back the batch the last successful segment_append() stored, when it
+ * could not be synced. Only valid right after that append, under the same
+ * hold of file_mutex.
+ * @return 0 on success, -1 if the files could not be truncated
+ */
+int segment_undo_append(void);
+
+/**
+ * fdatasync() the tail segment and its index. The caller holds file_mutex.
+ * @return 0 on success, -1 on failure
+ */
+int segment_sync(void);
+
+/**
+ * Take a reference on the segment holding history offset @param offset, so
+ * it stays readable even if retention deletes it meanwhile.
+ * @param file_offset receives where @param offset is in the segment file
+ * @param avail receives how many bytes from there on the segment holds at
+ *      most; the tail's length is unbounded, callers clip to a snapshot
+ * @return the segment, or NULL if @param offset is no longer retained
+ */
+log_segment_t *segment_acquire(off_t offset, off_t *file_offset, size_t *avail);
+
+/**
+ * Drop a reference taken by segment_acquire().
+ */
+void segment_release(log_segment_t *segment);
+
+/**
+ * @return the data file of a segment referenced by the caller
+ */
+int segment_fd(const log_segment_t *segment);
+
+/**
+ * @return the history offset of the oldest byte still retained
+ */
+off_t segment_log_start(void);
+
+/**
+ * Find byte @param write_cmd_offset of record @param write_cmd, counting
+ * newline terminated records from the oldest retained one: the segment is
+ * picked by the record count its index starts at, the batch by a binary
+ * search of that index, and only that batch is scanned.
+ * @return 0 with the history offset in @param offset, or -1 with errno set,
+ *      EINVAL if the record or offset is out of range
+ */
+int segment_find_record(unsigned int write_cmd, unsigned int write_cmd_offset, off_t *offset);
+
+/**
+ * Arm the timer enforcing retain_seconds between appends. Call once the
+ * timer wheel is running.
+ */
+void segment_retention_start(void);
+
+#endif /* SEGMENT_LOG_H */
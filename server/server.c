@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,40 +14,56 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <time.h>
-#include <sys/queue.h>
-#include <sys/ioctl.h>
-#include "aesd_ioctl.h"
-
-#define PORT 9000
-#define BACKLOG 10
-#define BUFFER_SIZE 1024
-
-#ifdef USE_AESD_CHAR_DEVICE
-    #define FILE_PATH "/dev/aesdchar"
-#else
-    #define FILE_PATH "/var/tmp/aesdsocketdata"
-#endif
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <poll.h>
+
+#include "server.h"
+#include "connection.h"
+#include "history.h"
+#include "segment_log.h"
+#include "epoll_engine.h"
+#include "worker_pool.h"
+#include "uring_engine.h"
+#include "timer_wheel.h"
+#include "logger.h"
+#include "handoff.h"
+
+typedef enum {
+    ENGINE_THREAD,
+    ENGINE_EPOLL,
+    ENGINE_POOL,
+    ENGINE_URING
+} engine_t;
+
+#define MAX_LISTENERS 64
+#define TIMESTAMP_INTERVAL_MS 10000
+
+/**
+ * One listening socket and the thread accepting on it. With more than one,
+ * every socket is bound to PORT with SO_REUSEPORT and the kernel spreads
+ * incoming connections across them.
+ */
+typedef struct listener {
+    pthread_t thread;
+    int socket;
+    int cpu;                    // CPU the accept loop is pinned to, -1 for none
+} listener_t;
 
-int server_socket = -1;
+listener_t listeners[MAX_LISTENERS];
+int listener_count = 1;
+engine_t engine = ENGINE_THREAD;
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 volatile sig_atomic_t exit_flag = 0;
+volatile sig_atomic_t handoff_flag = 0;
+int shutdown_event_fd = -1;
 
-typedef struct {
-    int client_socket;
-    struct sockaddr_in client_addr;
-} thread_args_t;
-
-typedef struct thread_node {
-    pthread_t thread;
-    SLIST_ENTRY(thread_node) entries;
-} thread_node_t;
-
-SLIST_HEAD(thread_list, thread_node) head = SLIST_HEAD_INITIALIZER(head);
+// Thread engine clients run detached, shutdown waits for client_threads to drop to 0
+static unsigned long client_threads = 0;
+static pthread_mutex_t client_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_threads_done = PTHREAD_COND_INITIALIZER;
 
-// Helper function to parse the AESDCHAR_IOCSEEKTO command
-int parse_seekto_command(const char *buffer, unsigned int *write_cmd, unsigned int *write_cmd_offset) {
-    return sscanf(buffer, "AESDCHAR_IOCSEEKTO:%u,%u", write_cmd, write_cmd_offset) == 2;
-}
+wheel_timer_t timestamp_timer;
 
 void print_file_to_stdout(const char *file_path) {
     FILE *file = fopen(file_path, "r");
@@ -102,7 +119,19 @@ void run_as_daemon() {
 void handle_signal(int signal) {
     syslog(LOG_INFO, "Caught signal %d, exiting", signal);
     exit_flag = 1;
-    close(server_socket);
+    // Wakes the accept loops and the io_uring engine
+    eventfd_write(shutdown_event_fd, 1);
+    // Refuses clients still in the backlog, unless the sockets were handed to a successor
+    if (!handoff_flag) {
+        for (int i = 0; i < listener_count; i++) {
+            shutdown(listeners[i].socket, SHUT_RDWR);
+        }
+    }
+}
+
+void handle_handoff_signal(int signal) {
+    syslog(LOG_INFO, "Caught signal %d, handing over to a new process", signal);
+    handoff_request();
 }
 
 void setup_signal_handlers() {
@@ -119,122 +148,96 @@ void setup_signal_handlers() {
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
-}
 
-void* handle_client(void* arg) {
-    thread_args_t* args = (thread_args_t*)arg;
-    int client_socket = args->client_socket;
-    struct sockaddr_in client_addr = args->client_addr;
-    free(arg);
+    sa.sa_handler = handle_handoff_signal;
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-
-    syslog(LOG_INFO, "Accepted connection from %s and socket_id:%d", inet_ntoa(client_addr.sin_addr), client_socket);
-
-    int file_fd = open(FILE_PATH, O_RDWR);
-    if (file_fd == -1) {
-        syslog(LOG_ERR, "Failed to open file: %s", strerror(errno));
-        close(client_socket);
-        return NULL;
-    }
-
-    while ((bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-
-        unsigned int write_cmd, write_cmd_offset;
-        if (parse_seekto_command(buffer, &write_cmd, &write_cmd_offset)) {
-            struct aesd_seekto seekto = {
-                .write_cmd = write_cmd,
-                .write_cmd_offset = write_cmd_offset
-            };
-
-            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-                syslog(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
-            } else {
-                // Read the content of the device and send it back over the socket
-                lseek(file_fd, 0, SEEK_SET);
-                ssize_t bytes_read;
-                while ((bytes_read = read(file_fd, buffer, BUFFER_SIZE)) > 0) {
-                    send(client_socket, buffer, bytes_read, 0);
-                }
-            }
-        } else {
-            pthread_mutex_lock(&file_mutex);
-            FILE* file = fdopen(file_fd, "a+");
-            if (file == NULL) {
-                syslog(LOG_ERR, "Failed to open file: %s", strerror(errno));
-                pthread_mutex_unlock(&file_mutex);
-                close(client_socket);
-                return NULL;
-            }
+    // sendfile() has no MSG_NOSIGNAL, a client closing mid-replay must not kill the server
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+}
 
-            fprintf(file, "%s", buffer);
-            fflush(file);
+void* handle_client(void* arg) {
+    client_conn_t* conn = (client_conn_t*)arg;
 
-            if (strchr(buffer, '\n') != NULL) {
-                fseek(file, 0, SEEK_SET);
-                while (fgets(buffer, BUFFER_SIZE, file) != NULL) {
-                    send(client_socket, buffer, strlen(buffer), 0);
-                }
-            }
+    conn_serve(conn);
+    conn_destroy(conn);
 
-            fclose(file);
-            pthread_mutex_unlock(&file_mutex);
-        }
+    pthread_mutex_lock(&client_threads_mutex);
+    if (--client_threads == 0) {
+        pthread_cond_broadcast(&client_threads_done);
     }
+    pthread_mutex_unlock(&client_threads_mutex);
+    return NULL;
+}
 
-    if (bytes_received == -1) {
-        syslog(LOG_ERR, "Failed to receive data: %s", strerror(errno));
-    }
+// Timer callback appending a timestamp record, re-armed for the next period
+void append_timestamp(void* arg) {
+    (void)arg;
 
-    syslog(LOG_INFO, "Closed connection from %s and socket_id:%d", inet_ntoa(client_addr.sin_addr), client_socket);
+    time_t now = time(NULL);
+    struct tm tm_info;
+    char timestamp[64];
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
 
-    close(client_socket);
-    close(file_fd);
-    return NULL;
+    if (history_append(-1, timestamp, strlen(timestamp)) == 0) {
+        conn_publish();
+    }
+    timer_arm(&timestamp_timer, TIMESTAMP_INTERVAL_MS);
 }
 
-void* append_timestamps() {
-    while (!exit_flag) {
-        sleep(10);
-
-        time_t now = time(NULL);
-        struct tm* tm_info = localtime(&now);
-        char timestamp[64];
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
-
-        pthread_mutex_lock(&file_mutex);
-        FILE* file = fopen(FILE_PATH, "a");
-        if (file != NULL) {
-            fprintf(file, "%s", timestamp);
-            fflush(file);
-            fclose(file);
-        }
-        pthread_mutex_unlock(&file_mutex);
-    }
-    return NULL;
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|pool|uring] [-n threads] [-w high_water_bytes] [-o disconnect|drop] [-s none|batch|interval_ms] [-l listeners] [-a] [-b backlog] [-i idle_ms] [-e evict_ms] [-L err|warning|info|debug] [-S segment_bytes] [-r retain_bytes] [-R retain_seconds]\n", program_name);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        run_as_daemon();
+// Hand an accepted socket to a new detached thread, which releases everything it holds on exit
+int spawn_client_thread(client_conn_t *conn) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    pthread_mutex_lock(&client_threads_mutex);
+    client_threads++;
+    pthread_mutex_unlock(&client_threads_mutex);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, handle_client, conn);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        log_msg(LOG_ERR, "Failed to create client thread: %s", strerror(ret));
+        conn_destroy(conn);
+        pthread_mutex_lock(&client_threads_mutex);
+        client_threads--;
+        pthread_mutex_unlock(&client_threads_mutex);
+        return -1;
     }
+    return 0;
+}
 
-    syslog(LOG_ERR, "------------ SERVER STARTING -----------------");
-#ifndef USE_AESD_CHAR_DEVICE
-    remove(FILE_PATH);
-#endif
-
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+int open_listener(int reuseport, int backlog) {
+    struct sockaddr_in server_addr;
+    int one = 1;
 
-    openlog("aesdsocket", LOG_PID, LOG_USER);
-    setup_signal_handlers();
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1) {
+        log_msg(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+    // A restart must not fail while connections of the previous run sit in TIME_WAIT
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        (reuseport && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)) {
+        log_msg(LOG_ERR, "Failed to set socket options: %s", strerror(errno));
+        close(listen_socket);
         return -1;
     }
 
@@ -243,77 +246,335 @@ int main(int argc, char *argv[]) {
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(PORT);
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
-        close(server_socket);
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        log_msg(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
+        close(listen_socket);
         return -1;
     }
 
-    if (listen(server_socket, BACKLOG) == -1) {
-        syslog(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
-        close(server_socket);
+    if (listen(listen_socket, backlog) == -1) {
+        log_msg(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
+        close(listen_socket);
         return -1;
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    pthread_t timestamp_thread;
-    if (pthread_create(&timestamp_thread, NULL, append_timestamps, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
-        close(server_socket);
-        return -1;
+    return listen_socket;
+}
+
+void close_listeners(int count) {
+    for (int i = 0; i < count; i++) {
+        close(listeners[i].socket);
     }
-#endif
+}
+
+// Accept on one listener and hand each client to the engine until shutdown
+void* accept_loop(void* arg) {
+    listener_t* listener = (listener_t*)arg;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len;
+    // A handoff has to stop accept() without shutting the listening socket down
+    struct pollfd pfds[2] = {
+        { .fd = listener->socket, .events = POLLIN },
+        { .fd = shutdown_event_fd, .events = POLLIN }
+    };
+
+    if (listener->cpu >= 0) {
+        // Client threads of the thread engine inherit the CPU, keeping each shard on its core
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            log_msg(LOG_WARNING, "Failed to pin listener to CPU %d: %s", listener->cpu, strerror(err));
+        }
+    }
+
+    while (!exit_flag && !handoff_flag) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Failed to poll listening socket: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents != 0) {
+            break;
+        }
 
-    while (!exit_flag) {
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+        client_addr_len = sizeof(client_addr);
+        int client_socket = accept(listener->socket, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_socket == -1) {
             if (exit_flag) break;
-            syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            log_msg(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
             continue;
         }
 
-        thread_args_t* args = malloc(sizeof(thread_args_t));
-        if (args == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory for thread args: %s", strerror(errno));
-            close(client_socket);
+        client_conn_t* conn = conn_create(client_socket, &client_addr);
+        if (conn == NULL) {
             continue;
         }
-        args->client_socket = client_socket;
-        args->client_addr = client_addr;
-
-        thread_node_t* new_node = malloc(sizeof(thread_node_t));
-        if (new_node == NULL) {
-            syslog(LOG_ERR, "Failed to allocate memory for thread node: %s", strerror(errno));
-            close(client_socket);
-            free(args);
-            continue;
+
+        if (engine == ENGINE_EPOLL) {
+            epoll_engine_add(conn);
+        } else if (engine == ENGINE_POOL) {
+            worker_pool_submit(conn);
+        } else {
+            spawn_client_thread(conn);
         }
+    }
+    return NULL;
+}
 
-        if (pthread_create(&new_node->thread, NULL, handle_client, args) != 0) {
-            syslog(LOG_ERR, "Failed to create client thread: %s", strerror(errno));
-            close(client_socket);
-            free(args);
-            free(new_node);
-            continue;
+int main(int argc, char *argv[]) {
+    int daemon_mode = 0;
+    int pin_listeners = 0;
+    int backlog = BACKLOG;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int sockets[MAX_LISTENERS];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dm:n:w:o:s:l:ab:i:e:L:S:r:R:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    engine = ENGINE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    engine = ENGINE_POOL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'n':
+                num_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                out_high_water = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                if (strcmp(optarg, "disconnect") == 0) {
+                    out_overflow_policy = OVERFLOW_DISCONNECT;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    out_overflow_policy = OVERFLOW_DROP;
+                } else {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "none") == 0) {
+                    history_sync_policy = SYNC_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    history_sync_policy = SYNC_BATCH;
+                } else {
+                    char *end;
+                    history_sync_interval_ms = strtoul(optarg, &end, 10);
+                    if (*end != '\0' || end == optarg) {
+                        print_usage(argv[0]);
+                        return -1;
+                    }
+                    history_sync_policy = SYNC_INTERVAL;
+                }
+                break;
+            case 'l':
+                listener_count = strtol(optarg, NULL, 10);
+                break;
+            case 'a':
+                pin_listeners = 1;
+                break;
+            case 'b':
+                backlog = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                idle_timeout_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                evict_timeout_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                if (strcmp(optarg, "err") == 0) {
+                    log_level = LOG_ERR;
+                } else if (strcmp(optarg, "warning") == 0) {
+                    log_level = LOG_WARNING;
+                } else if (strcmp(optarg, "info") == 0) {
+                    log_level = LOG_INFO;
+                } else if (strcmp(optarg, "debug") == 0) {
+                    log_level = LOG_DEBUG;
+                } else {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'S':
+                segment_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                retain_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'R':
+                retain_seconds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
         }
+    }
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    // 0 asks for one listener per online CPU
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (listener_count < 1) {
+        listener_count = num_cpus;
+    }
+    if (listener_count > MAX_LISTENERS) {
+        listener_count = MAX_LISTENERS;
+    }
+    if (backlog < 1) {
+        backlog = BACKLOG;
+    }
+    if (segment_bytes == 0) {
+        segment_bytes = SEGMENT_DEFAULT_BYTES;
+    }
+
+    if (handoff_init(argv) == -1) {
+        return -1;
+    }
+    // A predecessor passes its sockets once it has closed the history, so this waits before history_init()
+    int inherited = handoff_receive(sockets, MAX_LISTENERS);
+    if (inherited == -1) {
+        return -1;
+    }
+    if (inherited > 0) {
+        listener_count = inherited;
+    }
 
-        SLIST_INSERT_HEAD(&head, new_node, entries);
+    if (daemon_mode) {
+        run_as_daemon();
+    }
 
+    log_msg(LOG_ERR, "------------ SERVER STARTING -----------------");
+    if (history_init() == -1) {
+        return -1;
+    }
+
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+
+    shutdown_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_event_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create shutdown eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < listener_count; i++) {
+        listeners[i].socket = inherited > 0 ? sockets[i] : open_listener(listener_count > 1, backlog);
+        listeners[i].cpu = pin_listeners ? i % num_cpus : -1;
+        if (listeners[i].socket == -1) {
+            close_listeners(i);
+            return -1;
+        }
+    }
+    setup_signal_handlers();
+
+    if (engine == ENGINE_URING && uring_engine_start() == -1) {
+        log_msg(LOG_WARNING, "io_uring unavailable, falling back to the epoll engine");
+        engine = ENGINE_EPOLL;
+    }
+
+    if ((engine == ENGINE_EPOLL && epoll_engine_start(num_threads) == -1) ||
+        (engine == ENGINE_POOL && worker_pool_start(num_threads) == -1)) {
+        close_listeners(listener_count);
+        return -1;
+    }
+
+    // One thread drives every deadline: timestamps, idle clients and slow readers
+    if (timer_wheel_start() == -1) {
+        close_listeners(listener_count);
+        return -1;
+    }
+    if (handoff_start() == -1) {
+        log_msg(LOG_WARNING, "Handoff on SIGUSR2 unavailable");
     }
 
 #ifndef USE_AESD_CHAR_DEVICE
-    pthread_join(timestamp_thread, NULL);
+    // Timestamps go through the segment log like any record, no file of their own
+    timer_init(&timestamp_timer, append_timestamp, NULL);
+    timer_arm(&timestamp_timer, TIMESTAMP_INTERVAL_MS);
+    segment_retention_start();
 #endif
 
-    thread_node_t* node;
-    while (!SLIST_EMPTY(&head)) {
-        node = SLIST_FIRST(&head);
-        pthread_join(node->thread, NULL);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(node);
+    // Setup errors above are logged synchronously, from here on connection paths never wait on syslog
+    if (logger_start() == -1) {
+        log_msg(LOG_WARNING, "Logging synchronously");
     }
 
-    close(server_socket);
+    if (engine == ENGINE_URING) {
+        for (int i = 0; i < listener_count; i++) {
+            sockets[i] = listeners[i].socket;
+        }
+        uring_engine_run(sockets, listener_count);
+    } else {
+        // The first listener runs on the main thread, the others get their own
+        int started = 1;
+        while (started < listener_count &&
+               pthread_create(&listeners[started].thread, NULL, accept_loop, &listeners[started]) == 0) {
+            started++;
+        }
+        if (started < listener_count) {
+            log_msg(LOG_ERR, "Failed to create listener thread, accepting on %d of %d sockets", started, listener_count);
+        }
+        log_msg(LOG_INFO, "Accepting on %d listener(s) with backlog %d", started, backlog);
+
+        accept_loop(&listeners[0]);
+        for (int i = 1; i < started; i++) {
+            pthread_join(listeners[i].thread, NULL);
+        }
+    }
+
+    // Nothing is accepted any more; after a handoff the connections finish before the engines stop
+    handoff_stop();
+    if (handoff_flag) {
+        conn_wait_all_closed();
+        exit_flag = 1;
+    }
+
+    if (engine == ENGINE_EPOLL) {
+        epoll_engine_stop();
+    } else if (engine == ENGINE_POOL) {
+        worker_pool_stop();
+    }
+
+    pthread_mutex_lock(&client_threads_mutex);
+    while (client_threads > 0) {
+        pthread_cond_wait(&client_threads_done, &client_threads_mutex);
+    }
+    pthread_mutex_unlock(&client_threads_mutex);
+
+    timer_wheel_stop();
+
+    // Every other thread is gone, the summary goes straight to syslog
+    logger_stop();
+    history_sync();
+    conn_log_send_stats();
+    history_log_stats();
+    history_close();
+
+    if (handoff_flag) {
+        for (int i = 0; i < listener_count; i++) {
+            sockets[i] = listeners[i].socket;
+        }
+        handoff_send(sockets, listener_count);
+    }
+    close_listeners(listener_count);
+    close(shutdown_event_fd);
     closelog();
     return 0;
 }
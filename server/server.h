@@ -0,0 +1,24 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+
+#define PORT 9000
+#define BACKLOG 10
+#define BUFFER_SIZE 1024
+#define RECV_BUFFER_SIZE 65536
+#define MAX_LINE_SIZE (16 * 1024 * 1024)      // Longest unterminated line a text client may leave buffered
+
+#ifdef USE_AESD_CHAR_DEVICE
+    #define FILE_PATH "/dev/aesdchar"
+#else
+    #define FILE_PATH "/var/tmp/aesdsocketdata"
+#endif
+
+extern pthread_mutex_t file_mutex;
+extern volatile sig_atomic_t exit_flag;
+extern int shutdown_event_fd;           // eventfd signalled along with exit_flag and handoff_flag
+extern volatile sig_atomic_t handoff_flag;  // Stop accepting and drain, the listening sockets go to a successor
+
+#endif /* SERVER_H */
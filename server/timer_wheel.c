@@ -0,0 +1,186 @@
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include "timer_wheel.h"
+#include "logger.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELAY (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+LIST_HEAD(timer_list, wheel_timer);
+
+static struct timer_list wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t current_tick = 0;           // Last tick processed
+static uint64_t start_ms = 0;
+
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond;           // Wakes the wheel thread early on stop
+static pthread_cond_t callback_done = PTHREAD_COND_INITIALIZER;
+static wheel_timer_t *running = NULL;       // Timer whose callback is executing
+static pthread_t wheel_thread;
+static int wheel_stop = 0;
+
+uint64_t timer_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Link @param timer into the slot matching its distance from current_tick; wheel_mutex must be held
+static void enqueue(wheel_timer_t *timer) {
+    if (timer->expires < current_tick) {
+        timer->expires = current_tick;
+    }
+    if (timer->expires - current_tick > WHEEL_MAX_DELAY) {
+        timer->expires = current_tick + WHEEL_MAX_DELAY;
+    }
+
+    uint64_t delta = timer->expires - current_tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    unsigned int slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    LIST_INSERT_HEAD(&wheel[level][slot], timer, entries);
+    timer->pending = 1;
+}
+
+void timer_init(wheel_timer_t *timer, timer_fn_t fn, void *arg) {
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void timer_arm(wheel_timer_t *timer, unsigned long delay_ms) {
+    pthread_mutex_lock(&wheel_mutex);
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+    }
+
+    // Deadlines are measured from the wall time, not from a wheel that may be running behind
+    uint64_t now_tick = (timer_now_ms() - start_ms) / WHEEL_TICK_MS;
+    uint64_t ticks = (delay_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    timer->expires = now_tick + (ticks > 0 ? ticks : 1);
+    enqueue(timer);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+void timer_cancel(wheel_timer_t *timer) {
+    pthread_mutex_lock(&wheel_mutex);
+    // A running callback may re-arm its timer, so only unlink once it has returned
+    while (running == timer) {
+        pthread_cond_wait(&callback_done, &wheel_mutex);
+    }
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+        timer->pending = 0;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Re-file every timer of one coarse slot; each is now less than a slot of this level away, so it moves down
+static void cascade(int level) {
+    struct timer_list *slot = &wheel[level][(current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    wheel_timer_t *timer;
+
+    while ((timer = LIST_FIRST(slot)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        enqueue(timer);
+    }
+}
+
+// Advance one tick and run what expires on it; called with wheel_mutex held
+static void advance(void) {
+    struct timer_list expired = LIST_HEAD_INITIALIZER(expired);
+    wheel_timer_t *timer;
+
+    current_tick++;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((current_tick & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        cascade(level);
+    }
+
+    struct timer_list *slot = &wheel[0][current_tick & WHEEL_MASK];
+    while ((timer = LIST_FIRST(slot)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        LIST_INSERT_HEAD(&expired, timer, entries);
+    }
+
+    // Still pending while parked on expired, so timer_cancel() can unlink it there
+    while ((timer = LIST_FIRST(&expired)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        timer->pending = 0;
+        running = timer;
+        pthread_mutex_unlock(&wheel_mutex);
+
+        timer->fn(timer->arg);
+
+        pthread_mutex_lock(&wheel_mutex);
+        running = NULL;
+        pthread_cond_broadcast(&callback_done);
+    }
+}
+
+static void *wheel_loop(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wheel_mutex);
+    while (!wheel_stop) {
+        uint64_t target = (timer_now_ms() - start_ms) / WHEEL_TICK_MS;
+        while (current_tick < target && !wheel_stop) {
+            advance();
+        }
+
+        uint64_t wake_ms = start_ms + (current_tick + 1) * WHEEL_TICK_MS;
+        struct timespec deadline = {
+            .tv_sec = wake_ms / 1000,
+            .tv_nsec = (wake_ms % 1000) * 1000000
+        };
+        pthread_cond_timedwait(&wheel_cond, &wheel_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+    return NULL;
+}
+
+int timer_wheel_start(void) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel[level][slot]);
+        }
+    }
+    start_ms = timer_now_ms();
+    current_tick = 0;
+    wheel_stop = 0;
+
+    int err = pthread_create(&wheel_thread, NULL, wheel_loop, NULL);
+    if (err != 0) {
+        log_msg(LOG_ERR, "Failed to create timer thread: %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+void timer_wheel_stop(void) {
+    pthread_mutex_lock(&wheel_mutex);
+    wheel_stop = 1;
+    pthread_cond_signal(&wheel_cond);
+    pthread_mutex_unlock(&wheel_mutex);
+
+    pthread_join(wheel_thread, NULL);
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define WHEEL_TICK_MS 100
+
+typedef void (*timer_fn_t)(void *arg);
+
+/**
+ * A one-shot timer, embedded in whatever it times. Timers live in a
+ * hierarchical wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots, each level
+ * WHEEL_SLOTS times coarser than the one below, so arming and cancelling are
+ * O(1) however many timers are pending. A timer far out sits in a coarse
+ * slot and cascades down a level each time the level below wraps around.
+ */
+typedef struct wheel_timer {
+    LIST_ENTRY(wheel_timer) entries;
+    uint64_t expires;           // Tick the timer fires at
+    int pending;                // Linked into a slot
+    timer_fn_t fn;
+    void *arg;
+} wheel_timer_t;
+
+/**
+ * Set up @param timer to call @param fn with @param arg. Must be called once
+ * before the timer is armed.
+ */
+void timer_init(wheel_timer_t *timer, timer_fn_t fn, void *arg);
+
+/**
+ * Arm @param timer to fire @param delay_ms from now, rounded up to a whole
+ * tick; a pending timer is moved to the new deadline. Safe from any thread,
+ * including from the timer's own callback.
+ */
+void timer_arm(wheel_timer_t *timer, unsigned long delay_ms);
+
+/**
+ * Disarm @param timer. If its callback is running, wait for it to return, so
+ * the timer can be freed afterwards. Must not be called from that callback.
+ */
+void timer_cancel(wheel_timer_t *timer);
+
+/**
+ * Start the thread that advances the wheel every WHEEL_TICK_MS and runs
+ * expired callbacks, one at a time and without the wheel lock held.
+ * @return 0 on success, -1 on failure
+ */
+int timer_wheel_start(void);
+
+/**
+ * Stop the wheel thread. Timers still pending never fire.
+ */
+void timer_wheel_stop(void);
+
+/**
+ * @return CLOCK_MONOTONIC in milliseconds, the time base of the wheel
+ */
+uint64_t timer_now_ms(void);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,627 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "server.h"
+#include "connection.h"
+#include "uring_engine.h"
+#include "logger.h"
+
+#define URING_ENTRIES 1024
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 256         // Must be a power of two
+#define URING_BUF_SIZE 16384
+#define URING_STAGE_SIZE RECV_BUFFER_SIZE
+#define URING_MAX_SEND (1U << 30)
+
+// The request type lives in the low bits of user_data, next to the uring_conn_t pointer
+enum {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_CANCEL,
+    OP_RECV,
+    OP_READ,
+    OP_SEND,
+    OP_NOTIFY
+};
+#define OP_MASK 7
+
+typedef struct uring_conn {
+    client_conn_t *conn;
+    int inflight;           // Requests that will still post a completion
+    int sending;            // A send, or a read+send chain, is in flight
+    int closing;            // Socket shut down, freed once inflight drops to zero
+    char *stage;            // File bytes read for a linked send
+    size_t stage_len;
+    LIST_ENTRY(uring_conn) entries;
+} uring_conn_t;
+
+static int ring_fd = -1;
+static void *ring_ptr = MAP_FAILED;
+static size_t ring_size = 0;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static size_t sqes_size = 0;
+
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int sq_entries;
+static unsigned int sq_local_tail;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_buf_ring *buf_ring = MAP_FAILED;
+static char *buf_base = NULL;
+static unsigned short buf_tail = 0;
+
+static LIST_HEAD(uring_conn_list, uring_conn) conns = LIST_HEAD_INITIALIZER(conns);
+static const int *listen_fds = NULL;
+static int listen_count = 0;
+static uint64_t accept_armed = 0;   // Bit per listener with an accept in flight
+static int stopping = 0;
+static uint64_t wake_value;
+
+// Older kernels reject the multishot flags with EINVAL, single-shot requests are re-armed instead
+static int multishot_accept = 1;
+static int multishot_recv = 1;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t tag(uring_conn_t *uconn, int op) {
+    return (uint64_t)(uintptr_t)uconn | op;
+}
+
+static int submit_and_wait(unsigned int wait_nr) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    while (sys_io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0) == -1) {
+        if (errno != EINTR) {
+            log_msg(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Make sure @param count SQEs can be queued back to back, so a linked chain is never split
+static int reserve_sqes(unsigned int count) {
+    if (sq_local_tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) <= sq_entries) {
+        return 0;
+    }
+    if (submit_and_wait(0) == -1) {
+        return -1;
+    }
+    return sq_local_tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) <= sq_entries ? 0 : -1;
+}
+
+static struct io_uring_sqe *next_sqe(void) {
+    struct io_uring_sqe *sqe = &sqes[sq_local_tail & *sq_mask];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+static void provide_buffer(unsigned short bid) {
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uintptr_t)(buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void teardown(void) {
+    if (buf_ring != MAP_FAILED) {
+        munmap(buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        buf_ring = MAP_FAILED;
+    }
+    free(buf_base);
+    buf_base = NULL;
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+        sqes = MAP_FAILED;
+    }
+    if (ring_ptr != MAP_FAILED) {
+        munmap(ring_ptr, ring_size);
+        ring_ptr = MAP_FAILED;
+    }
+    if (ring_fd != -1) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+int uring_engine_start(void) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring_fd == -1) {
+        log_msg(LOG_WARNING, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Completions must never be dropped, multishot bookkeeping relies on seeing all of them
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        log_msg(LOG_WARNING, "io_uring lacks required features (0x%x)", params.features);
+        teardown();
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        log_msg(LOG_WARNING, "Failed to map io_uring rings: %s", strerror(errno));
+        teardown();
+        return -1;
+    }
+
+    char *ring = ring_ptr;
+    sq_head = (unsigned int *)(ring + params.sq_off.head);
+    sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+    sq_mask = (unsigned int *)(ring + params.sq_off.ring_mask);
+    sq_array = (unsigned int *)(ring + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    cq_head = (unsigned int *)(ring + params.cq_off.head);
+    cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+    cq_mask = (unsigned int *)(ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    for (unsigned int i = 0; i < sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    sq_local_tail = *sq_tail;
+
+    buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (buf_ring == MAP_FAILED || buf_base == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate io_uring buffers: %s", strerror(errno));
+        teardown();
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)buf_ring,
+        .ring_entries = URING_BUF_COUNT,
+        .bgid = URING_BUF_GROUP
+    };
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        log_msg(LOG_WARNING, "Failed to register io_uring buffer ring: %s", strerror(errno));
+        teardown();
+        return -1;
+    }
+
+    buf_tail = 0;
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+        provide_buffer(bid);
+    }
+
+    log_msg(LOG_INFO, "Started io_uring engine with %u entries", sq_entries);
+    return 0;
+}
+
+// Accepts carry the listener index where other requests carry their connection
+static uint64_t accept_tag(int index) {
+    return (uint64_t)index << 3 | OP_ACCEPT;
+}
+
+static void arm_accept(int index) {
+    if (reserve_sqes(1) == -1) {
+        log_msg(LOG_ERR, "io_uring submission queue full, accept not armed");
+        return;
+    }
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fds[index];
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = accept_tag(index);
+    accept_armed |= (uint64_t)1 << index;
+}
+
+static int arm_recv(uring_conn_t *uconn) {
+    if (reserve_sqes(1) == -1) {
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uconn->conn->client_socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    if (multishot_recv) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    } else {
+        sqe->len = URING_BUF_SIZE;
+    }
+    sqe->user_data = tag(uconn, OP_RECV);
+    uconn->inflight++;
+    return 0;
+}
+
+// Poll a subscriber's notify_fd; conn_follow() reads it, the eventfd is non-blocking
+static int arm_notify(uring_conn_t *uconn) {
+    client_conn_t *conn = uconn->conn;
+
+    if (conn->notify_fd == -1 || conn->notify_watched || uconn->closing) {
+        return 0;
+    }
+    if (reserve_sqes(1) == -1) {
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->notify_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(uconn, OP_NOTIFY);
+    conn->notify_watched = 1;
+    uconn->inflight++;
+    return 0;
+}
+
+static void close_uconn(uring_conn_t *uconn) {
+    if (!uconn->closing) {
+        uconn->closing = 1;
+        // Makes the pending receive and any parked send complete
+        shutdown(uconn->conn->client_socket, SHUT_RDWR);
+        if (uconn->conn->notify_watched) {
+            eventfd_write(uconn->conn->notify_fd, 1);
+        }
+    }
+
+    if (uconn->inflight == 0) {
+        LIST_REMOVE(uconn, entries);
+        conn_destroy(uconn->conn);
+        free(uconn->stage);
+        free(uconn);
+    }
+}
+
+// Submit the head of the outbound queue; only one send is in flight per connection to keep order
+static int kick_send(uring_conn_t *uconn) {
+    client_conn_t *conn = uconn->conn;
+    out_chunk_t *chunk = STAILQ_FIRST(&conn->out_queue);
+
+    if (uconn->sending || uconn->closing || chunk == NULL) {
+        return 0;
+    }
+
+    size_t len = chunk->len - chunk->sent;
+    if (len > URING_MAX_SEND) {
+        len = URING_MAX_SEND;
+    }
+
+    if (chunk->data != NULL) {
+        if (reserve_sqes(1) == -1) {
+            return -1;
+        }
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->client_socket;
+        sqe->addr = (uintptr_t)(chunk->data + chunk->sent);
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(uconn, OP_SEND);
+        uconn->inflight++;
+    } else {
+        if (uconn->stage == NULL && (uconn->stage = malloc(URING_STAGE_SIZE)) == NULL) {
+            log_msg(LOG_ERR, "Failed to allocate io_uring stage buffer: %s", strerror(errno));
+            return -1;
+        }
+        if (len > URING_STAGE_SIZE) {
+            len = URING_STAGE_SIZE;
+        }
+        if (reserve_sqes(2) == -1) {
+            return -1;
+        }
+
+        // The send only runs if the read filled the whole stage buffer
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = segment_fd(chunk->segment);
+        sqe->addr = (uintptr_t)uconn->stage;
+        sqe->len = len;
+        sqe->off = chunk->offset + chunk->sent;
+        sqe->user_data = tag(uconn, OP_READ);
+
+        sqe = next_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->client_socket;
+        sqe->addr = (uintptr_t)uconn->stage;
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(uconn, OP_SEND);
+
+        uconn->stage_len = len;
+        uconn->inflight += 2;
+    }
+
+    uconn->sending = 1;
+    return 0;
+}
+
+// Send what the protocol queued, and close once a half-closed peer has all its replies
+static void after_io(uring_conn_t *uconn) {
+    client_conn_t *conn = uconn->conn;
+
+    if (arm_notify(uconn) == -1 || kick_send(uconn) == -1) {
+        close_uconn(uconn);
+        return;
+    }
+    if (conn->read_closed && !uconn->sending && conn->out_pending == 0) {
+        close_uconn(uconn);
+    }
+}
+
+static void handle_accept(int index, int res, unsigned int flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        accept_armed &= ~((uint64_t)1 << index);
+    }
+
+    if (res >= 0) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        // An accept completing during a handoff is served, the connection drains like the others
+        if (exit_flag) {
+            close(res);
+            return;
+        }
+
+        // Multishot accept has no per-connection address buffer
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(res, (struct sockaddr *)&client_addr, &client_addr_len);
+
+        client_conn_t *conn = conn_create(res, &client_addr);
+        uring_conn_t *uconn = conn != NULL ? calloc(1, sizeof(uring_conn_t)) : NULL;
+        if (uconn == NULL) {
+            if (conn != NULL) {
+                conn_destroy(conn);
+            }
+        } else {
+            // io_uring parks requests on blocking sockets instead of failing them with EAGAIN
+            int sock_flags = fcntl(res, F_GETFL, 0);
+            fcntl(res, F_SETFL, sock_flags & ~O_NONBLOCK);
+            conn->async_send = 1;
+            uconn->conn = conn;
+            LIST_INSERT_HEAD(&conns, uconn, entries);
+            if (arm_recv(uconn) == -1) {
+                close_uconn(uconn);
+            }
+        }
+    } else if (exit_flag) {
+        // The signal handler shut the listener down, the wake-up completion follows
+    } else if (res == -EINVAL && multishot_accept) {
+        log_msg(LOG_WARNING, "Multishot accept not supported, using single-shot accepts");
+        multishot_accept = 0;
+    } else if (res != -ECANCELED) {
+        log_msg(LOG_ERR, "Failed to accept connection: %s", strerror(-res));
+    }
+
+    if (!(accept_armed & ((uint64_t)1 << index)) && !stopping && !exit_flag) {
+        arm_accept(index);
+    }
+}
+
+static void handle_recv(uring_conn_t *uconn, int res, unsigned int flags) {
+    client_conn_t *conn = uconn->conn;
+    int rearm = 0;
+    int failed = 0;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uconn->inflight--;
+        rearm = 1;
+    }
+
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!uconn->closing && conn_handle_data(conn, buf_base + (size_t)bid * URING_BUF_SIZE, res) == -1) {
+            failed = 1;
+        }
+        provide_buffer(bid);
+    } else if (res == 0) {
+        rearm = 0;
+        if (!uconn->closing && conn_end_of_input(conn) == -1) {
+            failed = 1;
+        }
+    } else if (res == -ENOBUFS) {
+        // Every buffer was in flight, they are back in the ring by now
+    } else if (res == -EINVAL && multishot_recv) {
+        log_msg(LOG_WARNING, "Multishot recv not supported, using single-shot receives");
+        multishot_recv = 0;
+    } else {
+        if (res != -ECANCELED) {
+            log_msg(LOG_ERR, "Failed to receive data: %s", strerror(-res));
+        }
+        failed = 1;
+    }
+
+    if (uconn->closing || failed) {
+        close_uconn(uconn);
+        return;
+    }
+    if (rearm && !conn->read_closed && arm_recv(uconn) == -1) {
+        close_uconn(uconn);
+        return;
+    }
+    after_io(uconn);
+}
+
+static void handle_read(uring_conn_t *uconn, int res) {
+    uconn->inflight--;
+
+    // A short read already cancelled the linked send; it cannot happen below the snapshot length
+    if (!uconn->closing && (res < 0 || (size_t)res != uconn->stage_len)) {
+        log_msg(LOG_ERR, "Failed to read history for socket_id:%d: %s", uconn->conn->client_socket,
+               res < 0 ? strerror(-res) : "short read");
+        close_uconn(uconn);
+        return;
+    }
+    if (uconn->closing) {
+        close_uconn(uconn);
+    }
+}
+
+static void handle_send(uring_conn_t *uconn, int res) {
+    uconn->inflight--;
+    uconn->sending = 0;
+
+    if (uconn->closing) {
+        close_uconn(uconn);
+        return;
+    }
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET) {
+            log_msg(LOG_ERR, "Failed to send data: %s", strerror(-res));
+        }
+        close_uconn(uconn);
+        return;
+    }
+
+    if (conn_complete_send(uconn->conn, res) == -1) {
+        close_uconn(uconn);
+        return;
+    }
+    after_io(uconn);
+}
+
+static void handle_notify(uring_conn_t *uconn, int res) {
+    uconn->inflight--;
+    uconn->conn->notify_watched = 0;
+
+    if (uconn->closing) {
+        close_uconn(uconn);
+        return;
+    }
+    if (res < 0) {
+        log_msg(LOG_ERR, "Failed to poll subscriber eventfd: %s", strerror(-res));
+        close_uconn(uconn);
+        return;
+    }
+    if (conn_follow(uconn->conn) == -1) {
+        close_uconn(uconn);
+        return;
+    }
+    after_io(uconn);
+}
+
+static void dispatch(uint64_t user_data, int res, unsigned int flags) {
+    uring_conn_t *uconn = (uring_conn_t *)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+
+    switch (user_data & OP_MASK) {
+        case OP_ACCEPT:
+            handle_accept(user_data >> 3, res, flags);
+            break;
+        case OP_WAKE:
+            stopping = 1;
+            break;
+        case OP_CANCEL:
+            break;
+        case OP_RECV:
+            handle_recv(uconn, res, flags);
+            break;
+        case OP_READ:
+            handle_read(uconn, res);
+            break;
+        case OP_SEND:
+            handle_send(uconn, res);
+            break;
+        case OP_NOTIFY:
+            handle_notify(uconn, res);
+            break;
+    }
+}
+
+static void begin_shutdown(void) {
+    for (int i = 0; i < listen_count; i++) {
+        if ((accept_armed & ((uint64_t)1 << i)) && reserve_sqes(1) == 0) {
+            struct io_uring_sqe *sqe = next_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = accept_tag(i);
+            sqe->user_data = tag(NULL, OP_CANCEL);
+        }
+    }
+
+    // A handoff lets connections finish, the loop runs until the last one closes
+    if (handoff_flag && !exit_flag) {
+        return;
+    }
+
+    uring_conn_t *uconn = LIST_FIRST(&conns);
+    while (uconn != NULL) {
+        uring_conn_t *next = LIST_NEXT(uconn, entries);
+        close_uconn(uconn);
+        uconn = next;
+    }
+}
+
+void uring_engine_run(const int *listen_sockets, int count) {
+    listen_fds = listen_sockets;
+    listen_count = count;
+    stopping = 0;
+
+    for (int i = 0; i < count; i++) {
+        arm_accept(i);
+    }
+    if (reserve_sqes(1) == 0) {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = shutdown_event_fd;
+        sqe->addr = (uintptr_t)&wake_value;
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = tag(NULL, OP_WAKE);
+    }
+
+    int shutdown_started = 0;
+    while (!stopping || accept_armed || !LIST_EMPTY(&conns)) {
+        if (submit_and_wait(1) == -1) {
+            break;
+        }
+
+        unsigned int head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            dispatch(user_data, res, flags);
+        }
+
+        if (stopping && !shutdown_started) {
+            shutdown_started = 1;
+            begin_shutdown();
+        }
+    }
+
+    teardown();
+}
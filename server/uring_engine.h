@@ -0,0 +1,22 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+/**
+ * Set up the io_uring instance and its provided receive buffers.
+ * @return 0 on success, -1 if io_uring is not available, in which case the
+ *      caller should fall back to another engine
+ */
+int uring_engine_start(void);
+
+/**
+ * Accept and serve clients of the @param count sockets in @param
+ * listen_sockets (at most 64) from the calling thread until
+ * shutdown_event_fd is signalled, then close every connection, or wait for
+ * them to drain after a handoff, and tear the ring down. Accepts and
+ * receives are multishot requests reading into a ring of provided buffers;
+ * replies are sent with IORING_OP_SEND, and file ranges as linked read+send
+ * chains.
+ */
+void uring_engine_run(const int *listen_sockets, int count);
+
+#endif /* URING_ENGINE_H */
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+#include "worker_pool.h"
+#include "logger.h"
+
+#define WORKER_QUEUE_DEPTH 64
+#define DISPATCH_EVENTS 64
+#define NOTIFY_TAG 1                // Low bit of the epoll data of a subscriber's notify_fd
+
+typedef struct worker {
+    pthread_t thread;
+    int index;
+    pthread_mutex_t mutex;                      // Protects the deque
+    client_conn_t *tasks[WORKER_QUEUE_DEPTH];   // Ring buffer, oldest task at head
+    unsigned int head;
+    unsigned int tail;
+    unsigned long tasks_run;
+    unsigned long stolen;
+} worker_t;
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
+static unsigned int next_worker = 0;
+
+// pending counts queued tasks; a worker reserves one before it looks for it in the deques
+// queued counts deque slots in use, a reserved task keeps its slot until it is taken
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_available = PTHREAD_COND_INITIALIZER;
+static unsigned int pending = 0;
+static unsigned int queued = 0;
+static int stopping = 0;
+
+// Every pool connection is registered EPOLLONESHOT, so it is reported once and then
+// left alone until the worker that handled the report arms it again
+static pthread_t dispatcher;
+static int dispatcher_started = 0;
+static int epoll_fd = -1;
+static int wake_fd = -1;            // eventfd that interrupts epoll_wait() to reap closed connections or stop
+
+// Closed connections wait on closed_list until the dispatcher is done with the batch of
+// events it may still hold for them
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(conn_list, client_conn) conn_list = LIST_HEAD_INITIALIZER(conn_list);
+static struct conn_list closed_list = LIST_HEAD_INITIALIZER(closed_list);
+
+static int is_stopping(void) {
+    pthread_mutex_lock(&pool_mutex);
+    int ret = stopping;
+    pthread_mutex_unlock(&pool_mutex);
+    return ret;
+}
+
+static int deque_push(worker_t *worker, client_conn_t *conn) {
+    int pushed = 0;
+
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->tail - worker->head < WORKER_QUEUE_DEPTH) {
+        worker->tasks[worker->tail++ % WORKER_QUEUE_DEPTH] = conn;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return pushed;
+}
+
+// The owner serves its own queue oldest first; thieves take from the other end
+static client_conn_t *deque_take(worker_t *owner, worker_t *thief) {
+    client_conn_t *conn = NULL;
+
+    pthread_mutex_lock(&owner->mutex);
+    if (owner->head != owner->tail) {
+        if (owner == thief) {
+            conn = owner->tasks[owner->head++ % WORKER_QUEUE_DEPTH];
+        } else {
+            conn = owner->tasks[--owner->tail % WORKER_QUEUE_DEPTH];
+        }
+    }
+    pthread_mutex_unlock(&owner->mutex);
+
+    return conn;
+}
+
+static client_conn_t *next_task(worker_t *self) {
+    pthread_mutex_lock(&pool_mutex);
+    while (pending == 0 && !stopping) {
+        pthread_cond_wait(&work_available, &pool_mutex);
+    }
+    if (stopping) {
+        pthread_mutex_unlock(&pool_mutex);
+        return NULL;
+    }
+    pending--;
+    pthread_mutex_unlock(&pool_mutex);
+
+    // The reservation guarantees a task is queued somewhere, it may just take a rescan to find it
+    client_conn_t *conn = NULL;
+    while (conn == NULL) {
+        conn = deque_take(self, self);
+        for (int i = 1; conn == NULL && i < worker_count; i++) {
+            conn = deque_take(&workers[(self->index + i) % worker_count], self);
+            if (conn != NULL) {
+                self->stolen++;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    queued--;
+    pthread_cond_signal(&space_available);
+    pthread_mutex_unlock(&pool_mutex);
+    return conn;
+}
+
+// Runs on the dispatcher: queue a task for @param conn unless one is queued or running already
+static void schedule(client_conn_t *conn) {
+    // The worker holding the connection sees the extra report and runs it again
+    if (__atomic_fetch_add(&conn->pool_runs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    while (queued >= (unsigned int)worker_count * WORKER_QUEUE_DEPTH && !stopping) {
+        pthread_cond_wait(&space_available, &pool_mutex);
+    }
+    if (stopping) {
+        // worker_pool_stop() destroys the connection
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+
+    // queued is below the total capacity, so at least one deque has room
+    for (int i = 0; i < worker_count; i++) {
+        if (deque_push(&workers[next_worker++ % worker_count], conn)) {
+            break;
+        }
+    }
+    queued++;
+    pending++;
+    pthread_cond_signal(&work_available);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void wake_dispatcher(void) {
+    if (eventfd_write(wake_fd, 1) == -1) {
+        log_msg(LOG_ERR, "Failed to write wake eventfd: %s", strerror(errno));
+    }
+}
+
+// pool_runs stays non zero, so the dispatcher never schedules the connection again
+static void close_connection(client_conn_t *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->client_socket, NULL);
+    if (conn->notify_watched) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->notify_fd, NULL);
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    LIST_REMOVE(conn, entries);
+    LIST_INSERT_HEAD(&closed_list, conn, entries);
+    pthread_mutex_unlock(&conn_mutex);
+
+    wake_dispatcher();
+}
+
+// Do whatever @param conn is ready for without blocking; @return -1 once it should be closed
+static int run_step(client_conn_t *conn) {
+    if (!conn->read_closed && conn_receive(conn) == -1) {
+        return -1;
+    }
+    // Cheap when nothing was committed: the eventfd read just fails with EAGAIN
+    if (conn->notify_fd != -1 && conn_follow(conn) == -1) {
+        return -1;
+    }
+    if (conn_flush(conn) == -1) {
+        return -1;
+    }
+
+    // Replies are flushed before honouring the peer's shutdown, like the blocking path does
+    return conn->read_closed && conn->out_pending == 0 ? -1 : 0;
+}
+
+// Hand @param conn back to the dispatcher, waiting for whatever it needs next
+static int rearm(client_conn_t *conn) {
+    struct epoll_event ev = {
+        .events = EPOLLONESHOT | (conn->read_closed ? 0 : EPOLLIN | EPOLLRDHUP) | (conn->out_pending > 0 ? EPOLLOUT : 0),
+        .data.ptr = conn
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->client_socket, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to rearm socket in epoll: %s", strerror(errno));
+        return -1;
+    }
+
+    if (conn->notify_fd == -1) {
+        return 0;
+    }
+
+    // A connection that just subscribed starts waiting on its notify_fd too
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = (void *)((uintptr_t)conn | NOTIFY_TAG);
+    if (epoll_ctl(epoll_fd, conn->notify_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->notify_fd, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to watch subscriber eventfd in epoll: %s", strerror(errno));
+        return -1;
+    }
+    conn->notify_watched = 1;
+    return 0;
+}
+
+static void run_task(client_conn_t *conn) {
+    unsigned int runs = __atomic_load_n(&conn->pool_runs, __ATOMIC_ACQUIRE);
+
+    do {
+        if (run_step(conn) == -1 || rearm(conn) == -1) {
+            close_connection(conn);
+            return;
+        }
+        // Reports that arrived while the step ran are handled here, not queued again
+        runs = __atomic_sub_fetch(&conn->pool_runs, runs, __ATOMIC_ACQ_REL);
+    } while (runs != 0);
+}
+
+static void* worker_run(void* arg) {
+    worker_t *self = (worker_t*)arg;
+    client_conn_t *conn;
+
+    while ((conn = next_task(self)) != NULL) {
+        run_task(conn);
+        self->tasks_run++;
+    }
+
+    return NULL;
+}
+
+static void reap_closed(void) {
+    client_conn_t *conn;
+
+    pthread_mutex_lock(&conn_mutex);
+    while ((conn = LIST_FIRST(&closed_list)) != NULL) {
+        LIST_REMOVE(conn, entries);
+        pthread_mutex_unlock(&conn_mutex);
+        conn_destroy(conn);
+        pthread_mutex_lock(&conn_mutex);
+    }
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+static void* dispatcher_run(void* arg) {
+    struct epoll_event events[DISPATCH_EVENTS];
+
+    (void)arg;
+    while (!is_stopping()) {
+        int n = epoll_wait(epoll_fd, events, DISPATCH_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+
+            if (data == 0) {
+                eventfd_t value;
+                eventfd_read(wake_fd, &value);
+                continue;
+            }
+            schedule((client_conn_t *)(data & ~(uintptr_t)NOTIFY_TAG));
+        }
+
+        // No event of this batch refers to a connection on closed_list any more
+        reap_closed();
+    }
+
+    return NULL;
+}
+
+static void destroy_list(struct conn_list *list) {
+    client_conn_t *conn;
+
+    while ((conn = LIST_FIRST(list)) != NULL) {
+        LIST_REMOVE(conn, entries);
+        conn_destroy(conn);
+    }
+}
+
+int worker_pool_start(int num_workers) {
+    workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate memory for worker pool: %s", strerror(errno));
+        return -1;
+    }
+
+    stopping = 0;
+    pending = 0;
+    queued = 0;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+        worker_pool_stop();
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create wake eventfd: %s", strerror(errno));
+        worker_pool_stop();
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to add wake eventfd to epoll: %s", strerror(errno));
+        worker_pool_stop();
+        return -1;
+    }
+
+    for (worker_count = 0; worker_count < num_workers; worker_count++) {
+        worker_t *worker = &workers[worker_count];
+
+        worker->index = worker_count;
+        pthread_mutex_init(&worker->mutex, NULL);
+
+        if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            log_msg(LOG_ERR, "Failed to create worker thread: %s", strerror(errno));
+            pthread_mutex_destroy(&worker->mutex);
+            worker_pool_stop();
+            return -1;
+        }
+    }
+
+    if (pthread_create(&dispatcher, NULL, dispatcher_run, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create dispatcher thread: %s", strerror(errno));
+        worker_pool_stop();
+        return -1;
+    }
+    dispatcher_started = 1;
+
+    log_msg(LOG_INFO, "Started worker pool with %d workers", worker_count);
+    return 0;
+}
+
+int worker_pool_submit(client_conn_t *conn) {
+    pthread_mutex_lock(&conn_mutex);
+    LIST_INSERT_HEAD(&conn_list, conn, entries);
+    pthread_mutex_unlock(&conn_mutex);
+
+    // Anything the client sent already is reported straight away
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->client_socket, &ev) == -1) {
+        log_msg(LOG_ERR, "Failed to add client socket to epoll: %s", strerror(errno));
+        pthread_mutex_lock(&conn_mutex);
+        LIST_REMOVE(conn, entries);
+        pthread_mutex_unlock(&conn_mutex);
+        conn_destroy(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+void worker_pool_stop(void) {
+    pthread_mutex_lock(&pool_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&work_available);
+    pthread_cond_broadcast(&space_available);
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (dispatcher_started) {
+        wake_dispatcher();
+        pthread_join(dispatcher, NULL);
+        dispatcher_started = 0;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        worker_t *worker = &workers[i];
+
+        pthread_join(worker->thread, NULL);
+        log_msg(LOG_INFO, "Worker %d ran %lu tasks, %lu stolen", i, worker->tasks_run, worker->stolen);
+        pthread_mutex_destroy(&worker->mutex);
+    }
+
+    // Queued tasks only point at connections, which are all on one of the lists
+    destroy_list(&conn_list);
+    destroy_list(&closed_list);
+
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
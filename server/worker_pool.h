@@ -0,0 +1,30 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "connection.h"
+
+/**
+ * Start @param num_workers long-lived worker threads and a dispatcher that
+ * waits for the connections to become readable or writable. Each ready
+ * connection is queued as a short task on a bounded worker deque; idle
+ * workers steal from the others, and a worker hands the connection back to
+ * the dispatcher once it would block, so neither a slow client nor a
+ * subscriber keeps a worker to itself.
+ * @return 0 on success, -1 on failure
+ */
+int worker_pool_start(int num_workers);
+
+/**
+ * Hand @param conn to the dispatcher, which queues a task for it whenever
+ * it is ready.
+ * @return 0 on success, -1 on failure (the connection is destroyed in that case)
+ */
+int worker_pool_submit(client_conn_t *conn);
+
+/**
+ * Stop the dispatcher, wait for the running tasks to finish and close every
+ * pool connection.
+ */
+void worker_pool_stop(void);
+
+#endif /* WORKER_POOL_H */
@@ -0,0 +1,329 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Tests for the configurable history depth of the circular buffer. The ring
+ * allocates the next power of two of slots and keeps depth entries in them,
+ * so these cover depths below the slot count, depth 1, locations wrapping past
+ * the mask and copying a ring into a smaller one like aesd_resize_history().
+ * The last ones cover the lookups built on the running entry offsets: the
+ * binary search at entry boundaries, walking with next_entry and write
+ * command offsets once the oldest entries were evicted.
+ */
+
+#define TEST_RECORDS 64
+
+static char records[TEST_RECORDS][16];
+
+// Record i is "<i>:" followed by i % 5 letters and a newline, so neighbouring entries differ in size
+static void make_records(void)
+{
+    for (int i = 0; i < TEST_RECORDS; i++) {
+        int len = snprintf(records[i], sizeof(records[i]), "%d:", i);
+        memset(records[i] + len, 'a' + i % 26, i % 5);
+        records[i][len + i % 5] = '\n';
+        records[i][len + i % 5 + 1] = '\0';
+    }
+}
+
+static const char *add_record(struct aesd_circular_buffer *buffer, int i)
+{
+    struct aesd_buffer_entry entry = { .buffptr = records[i], .size = strlen(records[i]) };
+
+    return aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+// Check that @param buffer holds records first .. last - 1, in order, byte for byte
+static void verify_records(struct aesd_circular_buffer *buffer, int first, int last)
+{
+    size_t total = 0;
+    char message[128];
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(last - first, aesd_circular_write_cmd_size(buffer),
+                                     "The buffer should hold one entry per record kept");
+
+    for (int i = first; i < last; i++) {
+        size_t len = strlen(records[i]);
+
+        for (size_t byte = 0; byte < len; byte++) {
+            size_t offset_rtn;
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(buffer, total + byte, &offset_rtn);
+
+            snprintf(message, sizeof(message), "Byte %zu of record %d at position %zu", byte, i, total + byte);
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i], entry->buffptr, message);
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(byte, offset_rtn, message);
+        }
+        total += len;
+    }
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(total, aesd_circular_buffer_size(buffer),
+                                     "The buffer size should be the sum of the records kept");
+}
+
+void test_circular_buffer_init_depth_limits()
+{
+    struct aesd_circular_buffer buffer;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_init_depth(&buffer, 0),
+                                  "A depth of 0 should be rejected");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_init_depth(&buffer, AESDCHAR_MAX_HISTORY_DEPTH + 1),
+                                  "A depth above AESDCHAR_MAX_HISTORY_DEPTH should be rejected");
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 16));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(15, buffer.mask, "A power of two depth should get exactly that many slots");
+    aesd_circular_buffer_free(&buffer);
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.depth);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(15, buffer.mask, "The default depth of 10 should get 16 slots");
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_depth_one()
+{
+    struct aesd_circular_buffer buffer;
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 1));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, buffer.mask, "A depth of 1 should get a single slot");
+
+    TEST_ASSERT_NULL_MESSAGE(add_record(&buffer, 0), "Nothing is overwritten while the buffer fills");
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "A single entry should fill a buffer of depth 1");
+    verify_records(&buffer, 0, 1);
+
+    // Every later add replaces the only entry
+    for (int i = 1; i < 8; i++) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i - 1], add_record(&buffer, i),
+                                      "Adding to a full buffer should return the entry it overwrote");
+        TEST_ASSERT_EQUAL_UINT32(0, buffer.in_offs);
+        TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+        verify_records(&buffer, i, i + 1);
+    }
+
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_depth_three()
+{
+    struct aesd_circular_buffer buffer;
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 3));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, buffer.mask, "A depth of 3 should get 4 slots");
+
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_NULL_MESSAGE(add_record(&buffer, i), "Nothing is overwritten while the buffer fills");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "Three entries should fill a buffer of depth 3");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(buffer.in_offs, buffer.out_offs,
+                                  "With a spare slot, a full buffer does not have in_offs == out_offs");
+    verify_records(&buffer, 0, 3);
+
+    // The fourth add uses the spare slot, the fifth wraps in_offs past the mask
+    TEST_ASSERT_EQUAL_PTR(records[0], add_record(&buffer, 3));
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.out_offs);
+    verify_records(&buffer, 1, 4);
+
+    TEST_ASSERT_EQUAL_PTR(records[1], add_record(&buffer, 4));
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.out_offs);
+    verify_records(&buffer, 2, 5);
+
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_depth_wraps_several_times()
+{
+    struct aesd_circular_buffer buffer;
+    const uint32_t depth = 10;
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, depth));
+
+    // 64 records go around the 16 slots four times
+    for (int i = 0; i < TEST_RECORDS; i++) {
+        const char *overwritten = add_record(&buffer, i);
+
+        if (i < (int)depth) {
+            TEST_ASSERT_NULL_MESSAGE(overwritten, "Nothing is overwritten while the buffer fills");
+        } else {
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i - depth], overwritten,
+                                          "Adding to a full buffer should return the oldest entry");
+        }
+        TEST_ASSERT_EQUAL_UINT32(i + 1 >= (int)depth, buffer.full);
+        verify_records(&buffer, i + 1 > (int)depth ? i + 1 - depth : 0, i + 1);
+    }
+
+    aesd_circular_buffer_free(&buffer);
+}
+
+// Copy @param from into a new ring of @param depth the way aesd_resize_history() does
+static void resize(struct aesd_circular_buffer *from, struct aesd_circular_buffer *to, uint32_t depth,
+                   const char **evicted, int *evicted_count)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(to, depth));
+    *evicted_count = 0;
+    for (entry = aesd_circular_buffer_find_entry_offset_for_fpos(from, 0, &offset); entry;
+         entry = aesd_circular_buffer_next_entry(from, entry)) {
+        const char *overwritten = aesd_circular_buffer_add_entry(to, entry);
+        if (overwritten != NULL) {
+            evicted[(*evicted_count)++] = overwritten;
+        }
+    }
+}
+
+void test_circular_buffer_resize()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer resized;
+    const char *evicted[TEST_RECORDS];
+    int evicted_count;
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 10));
+    for (int i = 0; i < 25; i++) {
+        add_record(&buffer, i);
+    }
+
+    // Shrinking keeps the newest entries and hands back the oldest ones in order
+    resize(&buffer, &resized, 4, evicted, &evicted_count);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, evicted_count, "Shrinking from 10 to 4 entries should evict 6");
+    for (int i = 0; i < evicted_count; i++) {
+        TEST_ASSERT_EQUAL_PTR(records[15 + i], evicted[i]);
+    }
+    verify_records(&resized, 21, 25);
+
+    // The smaller ring keeps working as a ring
+    TEST_ASSERT_EQUAL_PTR(records[21], add_record(&resized, 25));
+    verify_records(&resized, 22, 26);
+    aesd_circular_buffer_free(&resized);
+
+    // Growing keeps everything and leaves room for more
+    resize(&buffer, &resized, 32, evicted, &evicted_count);
+    TEST_ASSERT_EQUAL_INT(0, evicted_count);
+    TEST_ASSERT_FALSE(resized.full);
+    verify_records(&resized, 15, 25);
+    aesd_circular_buffer_free(&resized);
+
+    // Down to a single entry
+    resize(&buffer, &resized, 1, evicted, &evicted_count);
+    TEST_ASSERT_EQUAL_INT(9, evicted_count);
+    verify_records(&resized, 24, 25);
+    aesd_circular_buffer_free(&resized);
+
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_find_at_entry_boundaries_after_eviction()
+{
+    struct aesd_circular_buffer buffer;
+    char message[128];
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 5));
+
+    // 23 records evict 18, so out_pos is far from 0 and the entries wrap in the 8 slots
+    for (int i = 0; i < 23; i++) {
+        add_record(&buffer, i);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.out_pos > 0, "Eviction should advance out_pos");
+
+    size_t boundary = 0;
+    for (int i = 18; i < 23; i++) {
+        size_t len = strlen(records[i]);
+        size_t offset_rtn;
+        struct aesd_buffer_entry *entry;
+
+        snprintf(message, sizeof(message), "First byte of record %d at position %zu", i, boundary);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, boundary, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i], entry->buffptr, message);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, offset_rtn, message);
+
+        snprintf(message, sizeof(message), "Last byte of record %d at position %zu", i, boundary + len - 1);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, boundary + len - 1, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(records[i], entry->buffptr, message);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(len - 1, offset_rtn, message);
+
+        boundary += len;
+    }
+
+    size_t offset_rtn;
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, boundary, &offset_rtn),
+                             "The position just past the newest entry should not be found");
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_next_entry()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t offset;
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 6));
+
+    // Check the walk before the ring fills and after the entries wrap around the 8 slots
+    for (int i = 0; i < 20; i++) {
+        int first = i + 1 > 6 ? i + 1 - 6 : 0;
+        int expected = first;
+
+        add_record(&buffer, i);
+        for (entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset); entry;
+             entry = aesd_circular_buffer_next_entry(&buffer, entry)) {
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(records[expected], entry->buffptr, "Entries should be walked oldest first");
+            expected++;
+        }
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i + 1, expected, "The walk should end right after the newest entry");
+    }
+
+    // The newest entry, found directly, has no next one
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, aesd_circular_buffer_size(&buffer) - 1, &offset);
+    TEST_ASSERT_EQUAL_PTR(records[19], entry->buffptr);
+    TEST_ASSERT_NULL(aesd_circular_buffer_next_entry(&buffer, entry));
+    aesd_circular_buffer_free(&buffer);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 1));
+    add_record(&buffer, 0);
+    add_record(&buffer, 1);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_next_entry(&buffer, entry),
+                             "The only entry of a depth 1 buffer has no next one");
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_cmd_offset_after_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    char message[128];
+
+    make_records();
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 10));
+
+    // 37 records leave the newest 10 starting in the middle of the 16 slots
+    for (int i = 0; i < 37; i++) {
+        add_record(&buffer, i);
+    }
+
+    size_t expected = 0;
+    for (uint32_t write_cmd = 0; write_cmd < 10; write_cmd++) {
+        snprintf(message, sizeof(message), "Offset of write command %u", write_cmd);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, aesd_circular_calculate_cmd_offset(&buffer, write_cmd), message);
+        expected += strlen(records[27 + write_cmd]);
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, aesd_circular_calculate_cmd_offset(&buffer, 10),
+                                     "A write command past the newest entry should return 0");
+    aesd_circular_buffer_free(&buffer);
+}